@@ -64,9 +64,63 @@ typedef struct {
 
     size_t                                   padding;
     size_t                                   length;
+
+    /* the status of a fastcgi response, 0 until its headers are parsed */
+    ngx_uint_t                               code;
+
+    /* the part of an http11 response being parsed and its framing */
+    ngx_uint_t                               part;
+    off_t                                    content_length;
+    unsigned                                 chunked:1;
+    unsigned                                 close:1;
+
+    /* the pool holds allocations of the connection beside the buffer */
+    unsigned                                 reset_pool:1;
+
+    /*
+     * The stream of the current grpc check on the http2 connection and
+     * the DATA bytes to return to the connection window with the next.
+     */
+    ngx_uint_t                               stream_id;
+    size_t                                   window;
+
+    /*
+     * The elements left of a redis reply, the index of the next one and
+     * the role found in the reply to ROLE.
+     */
+    ngx_uint_t                               elements;
+    ngx_uint_t                               element;
+    ngx_uint_t                               role;
+
+    /* the connection pool, kept with the context for reuse */
+    ngx_pool_t                              *pool;
+    ngx_queue_t                              queue;
 } ngx_http_upstream_check_ctx_t;
 
 
+#define NGX_HTTP_CHECK_DURATION_BUCKETS      11
+
+
+#define NGX_HTTP_CHECK_PHASE_CONNECT         0
+#define NGX_HTTP_CHECK_PHASE_SEND            1
+#define NGX_HTTP_CHECK_PHASE_FIRST_BYTE      2
+#define NGX_HTTP_CHECK_PHASE_PARSE           3
+#define NGX_HTTP_CHECK_PHASES                4
+
+
+#define NGX_HTTP_CHECK_PASSIVE_SLOTS         8
+
+#define NGX_HTTP_CHECK_PASSIVE_COUNT_BITS    16
+#define NGX_HTTP_CHECK_PASSIVE_COUNT_MASK                                     \
+    (((ngx_atomic_uint_t) 1 << NGX_HTTP_CHECK_PASSIVE_COUNT_BITS) - 1)
+#define NGX_HTTP_CHECK_PASSIVE_EPOCH_MASK                                     \
+    ((ngx_atomic_uint_t) -1 >> NGX_HTTP_CHECK_PASSIVE_COUNT_BITS)
+
+
+/* the spacing of the checks of a peer in its fast start */
+#define NGX_HTTP_CHECK_FAST_START_INTERVAL   100
+
+
 typedef struct {
     ngx_shmtx_t                              mutex;
 #if (nginx_version >= 1002000)
@@ -82,23 +136,88 @@ typedef struct {
     ngx_uint_t                               fall_count;
     ngx_uint_t                               rise_count;
 
-    ngx_uint_t                               busyness;
-    ngx_uint_t                               access_count;
-
     struct sockaddr                         *sockaddr;
     socklen_t                                socklen;
+    uint32_t                                 upstream_hash;
 
     ngx_atomic_t                             down;
 
+    ngx_atomic_t                             checks;
+    ngx_atomic_t                             failures;
+    ngx_atomic_t                             timeouts;
+
+    /* non cumulative counts of ngx_http_upstream_check_duration_buckets */
+    ngx_atomic_t                             duration_sum;
+    ngx_atomic_t                             duration[NGX_HTTP_CHECK_DURATION_BUCKETS];
+
+    /*
+     * msec of the last check and the moving average scaled by 8, the
+     * average is stored plus one so 0 is left for no sample yet
+     */
+    ngx_atomic_t                             phase_last[NGX_HTTP_CHECK_PHASES];
+    ngx_atomic_t                             phase_avg[NGX_HTTP_CHECK_PHASES];
+
+    /* smoothed round trip time in msec scaled by 8, plus one as above */
+    ngx_atomic_t                             srtt;
+
+    /* when the peer went up, 0 once it has its full weight */
+    ngx_atomic_t                             recovered;
+
+    /* the adapted check interval, 0 for the configured one */
+    ngx_atomic_t                             interval;
+
+    /* set while the first rise checks of a new peer run back to back */
+    ngx_atomic_t                             fast_start;
+
+    /* the index + 1 of the peer checked on behalf of this one, or 0 */
+    ngx_atomic_t                             alias;
+
+    /*
+     * The failed responses seen by check_passive, one slot per window part
+     * holding both the epoch of the part and its count, so that a slot is
+     * recycled and counted in a single atomic operation.
+     */
+    ngx_atomic_t                             passive_slots[NGX_HTTP_CHECK_PASSIVE_SLOTS];
+
+    /* set by check_passive marking the peer down, for its check owner */
+    ngx_atomic_t                             passive_down;
+
     u_char                                   padding[64];
 } ngx_http_upstream_check_peer_shm_t;
 
 
+/*
+ * The counters touched on every proxied request live apart from the check
+ * state, one cache line per peer, and are only updated with atomic ops.
+ */
+typedef struct {
+    ngx_atomic_t                             busyness;
+    ngx_atomic_t                             access_count;
+
+    u_char                                   padding[NGX_CPU_CACHE_LINE
+                                                 - 2 * sizeof(ngx_atomic_t)];
+} ngx_http_upstream_check_peer_stat_t;
+
+
 typedef struct {
     ngx_uint_t                               generation;
     ngx_uint_t                               checksum;
     ngx_uint_t                               number;
 
+    ngx_http_upstream_check_peer_stat_t     *stats;
+
+    /* one bit per peer, set when it is down */
+    ngx_atomic_t                             map_generation;
+    ngx_atomic_t                            *down_map;
+
+    /*
+     * The peers still in their fast start, when it began and how long
+     * it took all of them to converge.
+     */
+    ngx_atomic_t                             converging;
+    ngx_msec_t                               converge_start;
+    ngx_msec_t                               ready_time;
+
     /* ngx_http_upstream_check_status_peer_t */
     ngx_http_upstream_check_peer_shm_t       peers[1];
 } ngx_http_upstream_check_peers_shm_t;
@@ -110,6 +229,14 @@ typedef struct {
 #define NGX_HTTP_CHECK_ALL_DONE              0x0008
 
 
+#define NGX_HTTP_CHECK_MAP_WORD_BITS         (8 * sizeof(ngx_atomic_uint_t))
+
+
+#define NGX_HTTP_CHECK_SHARD_OFF             0
+#define NGX_HTTP_CHECK_SHARD_OWN             1
+#define NGX_HTTP_CHECK_SHARD_OTHER           2
+
+
 typedef ngx_int_t (*ngx_http_upstream_check_packet_init_pt)
     (ngx_http_upstream_check_peer_t *peer);
 typedef ngx_int_t (*ngx_http_upstream_check_packet_parse_pt)
@@ -119,7 +246,6 @@ typedef void (*ngx_http_upstream_check_packet_clean_pt)
 
 struct ngx_http_upstream_check_peer_s {
     ngx_flag_t                               state;
-    ngx_pool_t                              *pool;
     ngx_uint_t                               index;
     ngx_uint_t                               max_busy;
     ngx_str_t                               *upstream_name;
@@ -129,6 +255,34 @@ struct ngx_http_upstream_check_peer_s {
     ngx_event_t                              check_timeout_ev;
     ngx_peer_connection_t                    pc;
 
+    ngx_queue_t                              wheel_queue;
+    ngx_uint_t                               wheel_expire;
+    ngx_flag_t                               wheel_set;
+
+    ngx_uint_t                               shard;
+
+    /*
+     * The peers with the same check share the one of the first of them,
+     * which links the others and updates their down bits too.
+     */
+    ngx_http_upstream_check_peer_t          *primary;
+    ngx_http_upstream_check_peer_t          *alias_next;
+
+    /* waiting for a check_max_inflight slot */
+    ngx_queue_t                              pending_queue;
+    unsigned                                 pending:1;
+    unsigned                                 inflight:1;
+
+    ngx_msec_t                               check_start;
+
+    ngx_uint_t                               phase;
+    ngx_msec_t                               phase_start;
+
+#if (NGX_HTTP_SSL)
+    /* the session of the last https check, resumed by the next one */
+    ngx_ssl_session_t                       *ssl_session;
+#endif
+
     void                                    *check_data;
     ngx_event_handler_pt                     send_handler;
     ngx_event_handler_pt                     recv_handler;
@@ -142,6 +296,16 @@ struct ngx_http_upstream_check_peer_s {
 };
 
 
+/* a temporary hash over the peers of the old zone, by sockaddr */
+typedef struct {
+    ngx_uint_t                              *buckets;
+    ngx_uint_t                              *next;
+    ngx_uint_t                               mask;
+
+    ngx_http_upstream_check_peers_shm_t     *peers_shm;
+} ngx_http_upstream_check_shm_index_t;
+
+
 typedef struct {
     ngx_str_t                                check_shm_name;
     ngx_uint_t                               checksum;
@@ -151,11 +315,47 @@ typedef struct {
 } ngx_http_upstream_check_peers_t;
 
 
+/*
+ * All the check events of a worker are kept in a two level timing wheel
+ * driven by a single timer, so the event timer tree does not grow with
+ * the number of peers. The inner wheel covers 256 ticks, the outer one
+ * 64 rotations of the inner wheel; longer delays are cascaded again.
+ */
+
+#define NGX_HTTP_CHECK_WHEEL_TICK            50
+
+#define NGX_HTTP_CHECK_WHEEL_BITS            8
+#define NGX_HTTP_CHECK_WHEEL_SIZE            (1 << NGX_HTTP_CHECK_WHEEL_BITS)
+#define NGX_HTTP_CHECK_WHEEL_MASK            (NGX_HTTP_CHECK_WHEEL_SIZE - 1)
+
+#define NGX_HTTP_CHECK_WHEEL_OUTER_BITS      6
+#define NGX_HTTP_CHECK_WHEEL_OUTER_SIZE      (1 << NGX_HTTP_CHECK_WHEEL_OUTER_BITS)
+#define NGX_HTTP_CHECK_WHEEL_OUTER_MASK      (NGX_HTTP_CHECK_WHEEL_OUTER_SIZE - 1)
+
+typedef struct {
+    ngx_event_t                              event;
+
+    ngx_uint_t                               tick;
+    ngx_msec_t                               time;
+
+    ngx_queue_t                              inner[NGX_HTTP_CHECK_WHEEL_SIZE];
+    ngx_queue_t                              outer[NGX_HTTP_CHECK_WHEEL_OUTER_SIZE];
+} ngx_http_upstream_check_wheel_t;
+
+
 #define NGX_HTTP_CHECK_TCP                   0x0001
 #define NGX_HTTP_CHECK_HTTP                  0x0002
 #define NGX_HTTP_CHECK_SSL_HELLO             0x0004
 #define NGX_HTTP_CHECK_MYSQL                 0x0008
 #define NGX_HTTP_CHECK_AJP                   0x0010
+#define NGX_HTTP_CHECK_HTTPS                 0x0020
+#define NGX_HTTP_CHECK_HTTP11                0x0040
+#define NGX_HTTP_CHECK_GRPC                  0x0080
+#define NGX_HTTP_CHECK_GRPCS                 0x0100
+#define NGX_HTTP_CHECK_REDIS                 0x0200
+#define NGX_HTTP_CHECK_MEMCACHED             0x0400
+
+#define NGX_HTTP_CHECK_SSL_VERIFY_DEPTH      1
 
 #define NGX_CHECK_HTTP_2XX                   0x0002
 #define NGX_CHECK_HTTP_3XX                   0x0004
@@ -185,24 +385,53 @@ typedef struct {
 } ngx_check_conf_t;
 
 
+typedef struct ngx_http_upstream_check_status_ctx_s
+    ngx_http_upstream_check_status_ctx_t;
+
 typedef void (*ngx_http_upstream_check_status_format_pt) (ngx_buf_t *b,
-    ngx_http_upstream_check_peers_t *peers, ngx_uint_t flag);
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index);
 
 typedef struct {
     ngx_str_t                                format;
     ngx_str_t                                content_type;
 
-    ngx_http_upstream_check_status_format_pt output;
+    /*
+     * The header and the peers are written once per pass, the footer
+     * after the last pass. The header and the footer may be NULL.
+     */
+    ngx_uint_t                               passes;
+
+    ngx_http_upstream_check_status_format_pt header;
+    ngx_http_upstream_check_status_format_pt peer;
+    ngx_http_upstream_check_status_format_pt footer;
 } ngx_check_status_conf_t;
 
 
 #define NGX_CHECK_STATUS_DOWN                0x0001
 #define NGX_CHECK_STATUS_UP                  0x0002
 
-typedef struct {
+#define NGX_CHECK_STATUS_ST_HEADER           0
+#define NGX_CHECK_STATUS_ST_PEERS            1
+#define NGX_CHECK_STATUS_ST_FOOTER           2
+#define NGX_CHECK_STATUS_ST_DONE             3
+
+struct ngx_http_upstream_check_status_ctx_s {
     ngx_check_status_conf_t                 *format;
     ngx_flag_t                               flag;
-} ngx_http_upstream_check_status_ctx_t;
+
+    ngx_http_upstream_check_peers_t         *peers;
+
+    /* the number of peers to show and of those already written */
+    ngx_uint_t                               count;
+    ngx_uint_t                               shown;
+
+    ngx_uint_t                               state;
+    ngx_uint_t                               pass;
+    ngx_uint_t                               index;
+
+    ngx_chain_t                             *free;
+    ngx_chain_t                             *busy;
+};
 
 
 typedef ngx_int_t (*ngx_http_upstream_check_status_command_pt)
@@ -216,6 +445,8 @@ typedef struct {
 
 typedef struct {
     ngx_uint_t                               check_shm_size;
+    ngx_flag_t                               check_shard;
+    ngx_uint_t                               check_max_inflight;
     ngx_http_upstream_check_peers_t         *peers;
 } ngx_http_upstream_check_main_conf_t;
 
@@ -225,9 +456,21 @@ struct ngx_http_upstream_check_srv_conf_s {
     ngx_uint_t                               fall_count;
     ngx_uint_t                               rise_count;
     ngx_msec_t                               check_interval;
+    ngx_msec_t                               check_interval_min;
+    ngx_msec_t                               check_interval_max;
     ngx_msec_t                               check_timeout;
+    ngx_msec_t                               slow_start;
     ngx_uint_t                               check_keepalive_requests;
 
+    ngx_uint_t                               passive_fails;
+    ngx_msec_t                               passive_window;
+    ngx_msec_t                               passive_slow;
+
+    ngx_uint_t                               check_max_inflight;
+    /* the checks of the upstream running in this worker */
+    ngx_uint_t                               inflight;
+    size_t                                   check_buffer_size;
+
     ngx_check_conf_t                        *check_type_conf;
     ngx_str_t                                send;
 
@@ -239,6 +482,17 @@ struct ngx_http_upstream_check_srv_conf_s {
     ngx_array_t                             *fastcgi_params;
 
     ngx_uint_t                               default_down;
+    ngx_uint_t                               fast_start;
+
+    ngx_str_t                                grpc_service;
+    ngx_uint_t                               redis_role;
+
+#if (NGX_HTTP_SSL)
+    ngx_ssl_t                               *ssl;
+    ngx_flag_t                               ssl_verify;
+    ngx_str_t                                ssl_trusted_certificate;
+    ngx_str_t                                ssl_name;
+#endif
 };
 
 
@@ -295,6 +549,9 @@ typedef struct {
 #define NGX_HTTP_FASTCGI_STDERR         7
 #define NGX_HTTP_FASTCGI_DATA           8
 
+#define NGX_HTTP_FASTCGI_END_REQUEST_SIZE      8
+#define NGX_HTTP_FASTCGI_REQUEST_COMPLETE      0
+
 
 typedef enum {
     ngx_http_fastcgi_st_version = 0,
@@ -310,6 +567,71 @@ typedef enum {
 } ngx_http_fastcgi_state_e;
 
 
+typedef enum {
+    ngx_http_check_http11_st_status = 0,
+    ngx_http_check_http11_st_headers,
+    ngx_http_check_http11_st_body,
+    ngx_http_check_http11_st_chunk_size,
+    ngx_http_check_http11_st_chunk_data,
+    ngx_http_check_http11_st_chunk_crlf,
+    ngx_http_check_http11_st_trailer,
+    ngx_http_check_http11_st_done
+} ngx_http_check_http11_state_e;
+
+
+#define NGX_HTTP_CHECK_H2_PREFACE       "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+#define NGX_HTTP_CHECK_H2_FRAME_SIZE    9
+
+#define NGX_HTTP_CHECK_H2_DATA          0x0
+#define NGX_HTTP_CHECK_H2_HEADERS       0x1
+#define NGX_HTTP_CHECK_H2_RST_STREAM    0x3
+#define NGX_HTTP_CHECK_H2_SETTINGS      0x4
+#define NGX_HTTP_CHECK_H2_PING          0x6
+#define NGX_HTTP_CHECK_H2_GOAWAY        0x7
+#define NGX_HTTP_CHECK_H2_WINDOW_UPDATE 0x8
+
+#define NGX_HTTP_CHECK_H2_END_STREAM    0x01
+#define NGX_HTTP_CHECK_H2_ACK           0x01
+#define NGX_HTTP_CHECK_H2_END_HEADERS   0x04
+#define NGX_HTTP_CHECK_H2_PADDED        0x08
+
+#define NGX_HTTP_CHECK_H2_ENABLE_PUSH   0x2
+#define NGX_HTTP_CHECK_H2_PING_SIZE     8
+
+/* a new connection is opened before the stream ids run out */
+#define NGX_HTTP_CHECK_H2_MAX_STREAM    0x7fffff00
+
+#define NGX_HTTP_CHECK_GRPC_PATH        "/grpc.health.v1.Health/Check"
+#define NGX_HTTP_CHECK_GRPC_TYPE        "application/grpc"
+
+/* a HealthCheckResponse message of the SERVING status */
+#define NGX_HTTP_CHECK_GRPC_SERVING     "\x00\x00\x00\x00\x02\x08\x01"
+
+/* the names are sent with single byte lengths */
+#define NGX_HTTP_CHECK_GRPC_MAX_NAME    127
+
+#define NGX_HTTP_CHECK_GRPC_ST_FRAME    0
+#define NGX_HTTP_CHECK_GRPC_ST_SKIP     1
+
+
+#define NGX_HTTP_CHECK_REDIS_MASTER     0x0001
+#define NGX_HTTP_CHECK_REDIS_REPLICA    0x0002
+#define NGX_HTTP_CHECK_REDIS_ANY        0x0003
+/* a replica until the state of its link to the master is known */
+#define NGX_HTTP_CHECK_REDIS_SLAVE      0x0004
+
+#define NGX_HTTP_CHECK_REDIS_PING       0
+#define NGX_HTTP_CHECK_REDIS_ROLE       1
+
+#define NGX_HTTP_CHECK_REDIS_ST_LINE    0
+#define NGX_HTTP_CHECK_REDIS_ST_BULK    1
+
+/* the index of the role and of the link state in the reply to ROLE */
+#define NGX_HTTP_CHECK_REDIS_ROLE_NAME  1
+#define NGX_HTTP_CHECK_REDIS_ROLE_STATE 4
+
+
 static ngx_http_fastcgi_request_start_t  ngx_http_fastcgi_request_start = {
     { 1,                                               /* version */
       NGX_HTTP_FASTCGI_BEGIN_REQUEST,                  /* type */
@@ -322,7 +644,7 @@ static ngx_http_fastcgi_request_start_t  ngx_http_fastcgi_request_start = {
 
     { 0,                                               /* role_hi */
       NGX_HTTP_FASTCGI_RESPONDER,                      /* role_lo */
-      0, /* NGX_HTTP_FASTCGI_KEEP_CONN */              /* flags */
+      NGX_HTTP_FASTCGI_KEEP_CONN,                      /* flags */
       { 0, 0, 0, 0, 0 } },                             /* reserved[5] */
 
     { 1,                                               /* version */
@@ -334,6 +656,21 @@ static ngx_http_fastcgi_request_start_t  ngx_http_fastcgi_request_start = {
 
 
 static ngx_int_t ngx_http_upstream_check_add_timers(ngx_cycle_t *cycle);
+static ngx_uint_t ngx_http_upstream_check_shard_hash(uint64_t key,
+    ngx_uint_t buckets);
+
+static void ngx_http_upstream_check_wheel_init(ngx_cycle_t *cycle);
+static void ngx_http_upstream_check_wheel_add(
+    ngx_http_upstream_check_peer_t *peer, ngx_msec_t delay);
+static void ngx_http_upstream_check_wheel_insert(
+    ngx_http_upstream_check_wheel_t *wheel,
+    ngx_http_upstream_check_peer_t *peer);
+static void ngx_http_upstream_check_wheel_handler(ngx_event_t *event);
+
+static ngx_int_t ngx_http_upstream_check_ctx_get(
+    ngx_http_upstream_check_peer_t *peer);
+static void ngx_http_upstream_check_ctx_free(
+    ngx_http_upstream_check_peer_t *peer);
 
 static ngx_int_t ngx_http_upstream_check_peek_one_byte(ngx_connection_t *c);
 
@@ -342,16 +679,53 @@ static void ngx_http_upstream_check_connect_handler(ngx_event_t *event);
 
 static void ngx_http_upstream_check_peek_handler(ngx_event_t *event);
 
+static void ngx_http_upstream_check_phase_done(
+    ngx_http_upstream_check_peer_t *peer, ngx_uint_t phase);
+static void ngx_http_upstream_check_rtt_update(
+    ngx_http_upstream_check_peer_t *peer, ngx_msec_t rtt);
+static ngx_msec_t ngx_http_upstream_check_peer_interval(
+    ngx_http_upstream_check_peer_t *peer);
+static void ngx_http_upstream_check_adapt_interval(
+    ngx_http_upstream_check_peer_t *peer, ngx_int_t result,
+    ngx_uint_t changed);
+static void ngx_http_upstream_check_fast_start_done(
+    ngx_http_upstream_check_peer_t *peer);
+static void ngx_http_upstream_check_map_set_peer(
+    ngx_http_upstream_check_peer_t *peer, ngx_uint_t down);
+static void ngx_http_upstream_check_passive_fail(
+    ngx_http_upstream_check_peer_t *peer);
+static ngx_int_t ngx_http_upstream_check_inflight_acquire(
+    ngx_http_upstream_check_peer_t *peer);
+static void ngx_http_upstream_check_inflight_release(
+    ngx_http_upstream_check_peer_t *peer);
+
 static void ngx_http_upstream_check_send_handler(ngx_event_t *event);
 static void ngx_http_upstream_check_recv_handler(ngx_event_t *event);
 
 static void ngx_http_upstream_check_discard_handler(ngx_event_t *event);
 static void ngx_http_upstream_check_dummy_handler(ngx_event_t *event);
 
+static void ngx_http_upstream_check_close_connection(
+    ngx_http_upstream_check_peer_t *peer);
+
+#if (NGX_HTTP_SSL)
+static void ngx_http_upstream_check_ssl_handshake(
+    ngx_http_upstream_check_peer_t *peer);
+static void ngx_http_upstream_check_ssl_handshake_handler(ngx_connection_t *c);
+static void ngx_http_upstream_check_ssl_ticket_handler(ngx_event_t *event);
+static void ngx_http_upstream_check_ssl_save_session(ngx_connection_t *c);
+static ngx_int_t ngx_http_upstream_check_init_ssl(ngx_conf_t *cf,
+    ngx_http_upstream_check_srv_conf_t *ucscf);
+#endif
+
 static ngx_int_t ngx_http_upstream_check_http_init(
     ngx_http_upstream_check_peer_t *peer);
 static ngx_int_t ngx_http_upstream_check_http_parse(
     ngx_http_upstream_check_peer_t *peer);
+static ngx_int_t ngx_http_upstream_check_http11_parse(
+    ngx_http_upstream_check_peer_t *peer);
+static ngx_int_t ngx_http_upstream_check_http11_header(
+    ngx_http_upstream_check_ctx_t *ctx, u_char *line, size_t len);
 static ngx_int_t ngx_http_upstream_check_parse_status_line(
     ngx_http_upstream_check_ctx_t *ctx, ngx_buf_t *b,
     ngx_http_status_t *status);
@@ -363,6 +737,8 @@ static ngx_buf_t *ngx_http_upstream_check_create_fastcgi_request(
 
 static ngx_int_t ngx_http_upstream_check_fastcgi_parse(
     ngx_http_upstream_check_peer_t *peer);
+static ngx_int_t ngx_http_upstream_check_fastcgi_headers(
+    ngx_http_upstream_check_ctx_t *ctx);
 static ngx_int_t ngx_http_upstream_check_fastcgi_process_record(
     ngx_http_upstream_check_ctx_t *ctx, ngx_buf_t *b,
     ngx_http_status_t *status);
@@ -370,6 +746,31 @@ static ngx_int_t ngx_http_upstream_check_parse_fastcgi_status(
     ngx_http_upstream_check_ctx_t *ctx, ngx_buf_t *b,
     ngx_http_status_t *status);
 
+static ngx_int_t ngx_http_upstream_check_grpc_init(
+    ngx_http_upstream_check_peer_t *peer);
+static void ngx_http_upstream_check_grpc_request(
+    ngx_http_upstream_check_peer_t *peer, ngx_uint_t preface);
+static u_char *ngx_http_upstream_check_h2_frame(u_char *p, size_t len,
+    ngx_uint_t type, ngx_uint_t flags, ngx_uint_t stream_id);
+static ngx_int_t ngx_http_upstream_check_h2_send(ngx_connection_t *c,
+    ngx_uint_t type, ngx_uint_t flags, u_char *payload, size_t len);
+static ngx_int_t ngx_http_upstream_check_grpc_parse(
+    ngx_http_upstream_check_peer_t *peer);
+static ngx_int_t ngx_http_upstream_check_grpc_read(
+    ngx_http_upstream_check_peer_t *peer);
+static void ngx_http_upstream_check_grpc_reinit(
+    ngx_http_upstream_check_peer_t *peer);
+
+static ngx_int_t ngx_http_upstream_check_redis_init(
+    ngx_http_upstream_check_peer_t *peer);
+static ngx_int_t ngx_http_upstream_check_redis_parse(
+    ngx_http_upstream_check_peer_t *peer);
+static void ngx_http_upstream_check_redis_reinit(
+    ngx_http_upstream_check_peer_t *peer);
+
+static ngx_int_t ngx_http_upstream_check_memcached_parse(
+    ngx_http_upstream_check_peer_t *peer);
+
 static ngx_int_t ngx_http_upstream_check_ssl_hello_init(
     ngx_http_upstream_check_peer_t *peer);
 static ngx_int_t ngx_http_upstream_check_ssl_hello_parse(
@@ -394,6 +795,9 @@ static void ngx_http_upstream_check_ajp_reinit(
 static void ngx_http_upstream_check_status_update(
     ngx_http_upstream_check_peer_t *peer,
     ngx_int_t result);
+static void ngx_http_upstream_check_map_set(
+    ngx_http_upstream_check_peers_shm_t *peers_shm, ngx_uint_t index,
+    ngx_uint_t down);
 
 static void ngx_http_upstream_check_clean_event(
     ngx_http_upstream_check_peer_t *peer);
@@ -415,12 +819,36 @@ static ngx_int_t ngx_http_upstream_check_status_command_format(
 static ngx_int_t ngx_http_upstream_check_status_command_status(
     ngx_http_upstream_check_status_ctx_t *ctx, ngx_str_t *value);
 
-static void ngx_http_upstream_check_status_html_format(ngx_buf_t *b,
-    ngx_http_upstream_check_peers_t *peers, ngx_uint_t flag);
-static void ngx_http_upstream_check_status_csv_format(ngx_buf_t *b,
-    ngx_http_upstream_check_peers_t *peers, ngx_uint_t flag);
-static void ngx_http_upstream_check_status_json_format(ngx_buf_t *b,
-    ngx_http_upstream_check_peers_t *peers, ngx_uint_t flag);
+static ngx_int_t ngx_http_upstream_check_status_send(ngx_http_request_t *r,
+    ngx_http_upstream_check_status_ctx_t *ctx);
+static void ngx_http_upstream_check_status_write_handler(
+    ngx_http_request_t *r);
+static ngx_chain_t *ngx_http_upstream_check_status_render(
+    ngx_http_request_t *r, ngx_http_upstream_check_status_ctx_t *ctx);
+static ngx_uint_t ngx_http_upstream_check_status_show(
+    ngx_http_upstream_check_status_ctx_t *ctx,
+    ngx_http_upstream_check_peer_t *peer);
+
+static void ngx_http_upstream_check_status_html_header(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index);
+static void ngx_http_upstream_check_status_html_peer(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index);
+static void ngx_http_upstream_check_status_html_footer(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index);
+static void ngx_http_upstream_check_status_csv_peer(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index);
+static void ngx_http_upstream_check_status_json_header(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index);
+static void ngx_http_upstream_check_status_json_peer(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index);
+static void ngx_http_upstream_check_status_json_footer(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index);
+static void ngx_http_upstream_check_status_openmetrics_header(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index);
+static void ngx_http_upstream_check_status_openmetrics_peer(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index);
+static void ngx_http_upstream_check_status_openmetrics_footer(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index);
 
 static ngx_int_t ngx_http_upstream_check_addr_change_port(ngx_pool_t *pool,
     ngx_addr_t *dst, ngx_addr_t *src, ngx_uint_t port);
@@ -431,6 +859,10 @@ static char *ngx_http_upstream_check(ngx_conf_t *cf,
     ngx_command_t *cmd, void *conf);
 static char *ngx_http_upstream_check_keepalive_requests(ngx_conf_t *cf,
     ngx_command_t *cmd, void *conf);
+static char *ngx_http_upstream_check_passive(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_http_upstream_check_max_inflight(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
 static char *ngx_http_upstream_check_http_send(ngx_conf_t *cf,
     ngx_command_t *cmd, void *conf);
 static char *ngx_http_upstream_check_http_expect_alive(ngx_conf_t *cf,
@@ -460,15 +892,26 @@ static char * ngx_http_upstream_check_merge_loc_conf(ngx_conf_t *cf,
 
 #define SHM_NAME_LEN 256
 
+static ngx_int_t ngx_http_upstream_check_dedup_peers(ngx_conf_t *cf,
+    ngx_http_upstream_check_peers_t *peers);
+static ngx_uint_t ngx_http_upstream_check_same_check(
+    ngx_http_upstream_check_peer_t *a, ngx_http_upstream_check_peer_t *b);
 static char *ngx_http_upstream_check_init_shm(ngx_conf_t *cf, void *conf);
 
+static size_t ngx_http_upstream_check_shm_layout(
+    ngx_http_upstream_check_peers_t *peers, size_t *map, size_t *stats,
+    size_t *addrs);
+
 static ngx_int_t ngx_http_upstream_check_get_shm_name(ngx_str_t *shm_name,
     ngx_pool_t *pool, ngx_uint_t generation);
 static ngx_shm_zone_t *ngx_shared_memory_find(ngx_cycle_t *cycle,
     ngx_str_t *name, void *tag);
+static ngx_int_t ngx_http_upstream_check_shm_index_init(
+    ngx_http_upstream_check_shm_index_t *index,
+    ngx_http_upstream_check_peers_shm_t *peers_shm, ngx_log_t *log);
 static ngx_http_upstream_check_peer_shm_t *
-ngx_http_upstream_check_find_shm_peer(ngx_http_upstream_check_peers_shm_t *peers_shm,
-    ngx_addr_t *addr);
+ngx_http_upstream_check_find_shm_peer(ngx_http_upstream_check_shm_index_t *index,
+    ngx_addr_t *addr, uint32_t upstream_hash);
 
 static ngx_int_t ngx_http_upstream_check_init_shm_peer(
     ngx_http_upstream_check_peer_shm_t *peer_shm,
@@ -491,6 +934,14 @@ static ngx_conf_bitmask_t  ngx_check_http_expect_alive_masks[] = {
 };
 
 
+static ngx_conf_enum_t  ngx_check_redis_roles[] = {
+    { ngx_string("master"), NGX_HTTP_CHECK_REDIS_MASTER },
+    { ngx_string("replica"), NGX_HTTP_CHECK_REDIS_REPLICA },
+    { ngx_string("any"), NGX_HTTP_CHECK_REDIS_ANY },
+    { ngx_null_string, 0 }
+};
+
+
 static ngx_command_t  ngx_http_upstream_check_commands[] = {
 
     { ngx_string("check"),
@@ -507,6 +958,20 @@ static ngx_command_t  ngx_http_upstream_check_commands[] = {
       0,
       NULL },
 
+    { ngx_string("check_passive"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE23,
+      ngx_http_upstream_check_passive,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("check_buffer_size"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_check_srv_conf_t, check_buffer_size),
+      NULL },
+
     { ngx_string("check_http_send"),
       NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
       ngx_http_upstream_check_http_send,
@@ -528,6 +993,45 @@ static ngx_command_t  ngx_http_upstream_check_commands[] = {
       0,
       NULL },
 
+    { ngx_string("check_grpc_service"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_check_srv_conf_t, grpc_service),
+      NULL },
+
+    { ngx_string("check_redis_role"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_check_srv_conf_t, redis_role),
+      &ngx_check_redis_roles },
+
+#if (NGX_HTTP_SSL)
+
+    { ngx_string("check_ssl_verify"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_check_srv_conf_t, ssl_verify),
+      NULL },
+
+    { ngx_string("check_ssl_trusted_certificate"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_check_srv_conf_t, ssl_trusted_certificate),
+      NULL },
+
+    { ngx_string("check_ssl_name"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_check_srv_conf_t, ssl_name),
+      NULL },
+
+#endif
+
     { ngx_string("check_shm_size"),
       NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
       ngx_http_upstream_check_shm_size,
@@ -535,6 +1039,20 @@ static ngx_command_t  ngx_http_upstream_check_commands[] = {
       0,
       NULL },
 
+    { ngx_string("check_max_inflight"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstream_check_max_inflight,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("check_shard"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_upstream_check_main_conf_t, check_shard),
+      NULL },
+
     { ngx_string("check_status"),
       NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1|NGX_CONF_NOARGS,
       ngx_http_upstream_check_status,
@@ -667,6 +1185,18 @@ static ngx_check_conf_t  ngx_check_types[] = {
       1,
       1 },
 
+    { NGX_HTTP_CHECK_HTTP11,
+      ngx_string("http11"),
+      ngx_string("GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"),
+      NGX_CONF_BITMASK_SET | NGX_CHECK_HTTP_2XX | NGX_CHECK_HTTP_3XX,
+      ngx_http_upstream_check_send_handler,
+      ngx_http_upstream_check_recv_handler,
+      ngx_http_upstream_check_http_init,
+      ngx_http_upstream_check_http11_parse,
+      ngx_http_upstream_check_http_reinit,
+      1,
+      1 },
+
     { NGX_HTTP_CHECK_HTTP,
       ngx_string("fastcgi"),
       ngx_null_string,
@@ -677,7 +1207,43 @@ static ngx_check_conf_t  ngx_check_types[] = {
       ngx_http_upstream_check_fastcgi_parse,
       ngx_http_upstream_check_http_reinit,
       1,
-      0 },
+      1 },
+
+    { NGX_HTTP_CHECK_GRPC,
+      ngx_string("grpc"),
+      ngx_null_string,
+      0,
+      ngx_http_upstream_check_send_handler,
+      ngx_http_upstream_check_recv_handler,
+      ngx_http_upstream_check_grpc_init,
+      ngx_http_upstream_check_grpc_parse,
+      ngx_http_upstream_check_grpc_reinit,
+      1,
+      1 },
+
+    { NGX_HTTP_CHECK_REDIS,
+      ngx_string("redis"),
+      ngx_string("PING\r\n"),
+      0,
+      ngx_http_upstream_check_send_handler,
+      ngx_http_upstream_check_recv_handler,
+      ngx_http_upstream_check_redis_init,
+      ngx_http_upstream_check_redis_parse,
+      ngx_http_upstream_check_redis_reinit,
+      1,
+      1 },
+
+    { NGX_HTTP_CHECK_MEMCACHED,
+      ngx_string("memcached"),
+      ngx_string("version\r\n"),
+      0,
+      ngx_http_upstream_check_send_handler,
+      ngx_http_upstream_check_recv_handler,
+      ngx_http_upstream_check_http_init,
+      ngx_http_upstream_check_memcached_parse,
+      ngx_http_upstream_check_http_reinit,
+      1,
+      1 },
 
     { NGX_HTTP_CHECK_SSL_HELLO,
       ngx_string("ssl_hello"),
@@ -715,6 +1281,36 @@ static ngx_check_conf_t  ngx_check_types[] = {
       1,
       0 },
 
+#if (NGX_HTTP_SSL)
+
+    /* a handshake only check without check_http_send */
+
+    { NGX_HTTP_CHECK_HTTPS,
+      ngx_string("https"),
+      ngx_null_string,
+      NGX_CONF_BITMASK_SET | NGX_CHECK_HTTP_2XX | NGX_CHECK_HTTP_3XX,
+      ngx_http_upstream_check_send_handler,
+      ngx_http_upstream_check_recv_handler,
+      ngx_http_upstream_check_http_init,
+      ngx_http_upstream_check_http_parse,
+      ngx_http_upstream_check_http_reinit,
+      1,
+      1 },
+
+    { NGX_HTTP_CHECK_GRPCS,
+      ngx_string("grpcs"),
+      ngx_null_string,
+      0,
+      ngx_http_upstream_check_send_handler,
+      ngx_http_upstream_check_recv_handler,
+      ngx_http_upstream_check_grpc_init,
+      ngx_http_upstream_check_grpc_parse,
+      ngx_http_upstream_check_grpc_reinit,
+      1,
+      1 },
+
+#endif
+
     { 0,
       ngx_null_string,
       ngx_null_string,
@@ -729,21 +1325,131 @@ static ngx_check_conf_t  ngx_check_types[] = {
 };
 
 
+typedef struct {
+    ngx_msec_t                               msec;
+    char                                    *le;
+} ngx_http_upstream_check_bucket_t;
+
+
+static ngx_http_upstream_check_bucket_t  ngx_http_upstream_check_duration_buckets[] = {
+    { 5, "0.005" },
+    { 10, "0.01" },
+    { 25, "0.025" },
+    { 50, "0.05" },
+    { 100, "0.1" },
+    { 250, "0.25" },
+    { 500, "0.5" },
+    { 1000, "1" },
+    { 2500, "2.5" },
+    { 5000, "5" },
+    { NGX_TIMER_INFINITE, "+Inf" }
+};
+
+
+static ngx_str_t  ngx_http_upstream_check_phase_names[] = {
+    ngx_string("connect"),
+    ngx_string("send"),
+    ngx_string("first_byte"),
+    ngx_string("parse")
+};
+
+
+#define ngx_http_upstream_check_phase_avg(shm, phase)                        \
+    (((shm)->phase_avg[phase] + 3) >> 3)
+
+
+/* one metric family per pass of the openmetrics format */
+
+typedef struct {
+    ngx_str_t                                name;
+    ngx_str_t                                type;
+    ngx_str_t                                unit;
+    ngx_str_t                                help;
+    ngx_uint_t                               counter;
+} ngx_http_upstream_check_metric_t;
+
+
+#define NGX_HTTP_CHECK_METRIC_UP             0
+#define NGX_HTTP_CHECK_METRIC_RISE           1
+#define NGX_HTTP_CHECK_METRIC_FALL           2
+#define NGX_HTTP_CHECK_METRIC_CHECKS         3
+#define NGX_HTTP_CHECK_METRIC_FAILURES       4
+#define NGX_HTTP_CHECK_METRIC_TIMEOUTS       5
+#define NGX_HTTP_CHECK_METRIC_REQUESTS       6
+#define NGX_HTTP_CHECK_METRIC_DURATION       7
+#define NGX_HTTP_CHECK_METRIC_PHASE          8
+#define NGX_HTTP_CHECK_METRIC_PHASE_AVG      9
+
+static ngx_http_upstream_check_metric_t  ngx_http_upstream_check_metrics[] = {
+
+    { ngx_string("up"), ngx_string("gauge"), ngx_null_string,
+      ngx_string("Whether the server passes its health check."), 0 },
+
+    { ngx_string("rise"), ngx_string("gauge"), ngx_null_string,
+      ngx_string("Consecutive successful checks."), 0 },
+
+    { ngx_string("fall"), ngx_string("gauge"), ngx_null_string,
+      ngx_string("Consecutive failed checks."), 0 },
+
+    { ngx_string("checks"), ngx_string("counter"), ngx_null_string,
+      ngx_string("Checks done."), 1 },
+
+    { ngx_string("failures"), ngx_string("counter"), ngx_null_string,
+      ngx_string("Checks failed."), 1 },
+
+    { ngx_string("timeouts"), ngx_string("counter"), ngx_null_string,
+      ngx_string("Checks timed out."), 1 },
+
+    { ngx_string("requests"), ngx_string("counter"), ngx_null_string,
+      ngx_string("Requests sent to the server."), 1 },
+
+    { ngx_string("duration_seconds"), ngx_string("histogram"),
+      ngx_string("seconds"),
+      ngx_string("Duration of the checks."), 0 },
+
+    { ngx_string("phase_seconds"), ngx_string("gauge"),
+      ngx_string("seconds"),
+      ngx_string("Duration of the check phases in the last check."), 0 },
+
+    { ngx_string("phase_average_seconds"), ngx_string("gauge"),
+      ngx_string("seconds"),
+      ngx_string("Moving average of the check phase durations."), 0 }
+};
+
+
 static ngx_check_status_conf_t  ngx_check_status_formats[] = {
 
     { ngx_string("html"),
       ngx_string("text/html"),
-      ngx_http_upstream_check_status_html_format },
+      1,
+      ngx_http_upstream_check_status_html_header,
+      ngx_http_upstream_check_status_html_peer,
+      ngx_http_upstream_check_status_html_footer },
 
     { ngx_string("csv"),
       ngx_string("text/plain"),
-      ngx_http_upstream_check_status_csv_format },
+      1,
+      NULL,
+      ngx_http_upstream_check_status_csv_peer,
+      NULL },
 
     { ngx_string("json"),
       ngx_string("application/json"), /* RFC 4627 */
-      ngx_http_upstream_check_status_json_format },
-
-    { ngx_null_string, ngx_null_string, NULL }
+      1,
+      ngx_http_upstream_check_status_json_header,
+      ngx_http_upstream_check_status_json_peer,
+      ngx_http_upstream_check_status_json_footer },
+
+    { ngx_string("openmetrics"),
+      ngx_string("application/openmetrics-text; version=1.0.0; "
+                 "charset=utf-8"),
+      sizeof(ngx_http_upstream_check_metrics)
+          / sizeof(ngx_http_upstream_check_metric_t),
+      ngx_http_upstream_check_status_openmetrics_header,
+      ngx_http_upstream_check_status_openmetrics_peer,
+      ngx_http_upstream_check_status_openmetrics_footer },
+
+    { ngx_null_string, ngx_null_string, 0, NULL, NULL, NULL }
 };
 
 
@@ -762,6 +1468,16 @@ static ngx_check_status_command_t ngx_check_status_commands[] =  {
 static ngx_uint_t ngx_http_upstream_check_shm_generation = 0;
 static ngx_http_upstream_check_peers_t *check_peers_ctx = NULL;
 
+static ngx_http_upstream_check_wheel_t  ngx_http_upstream_check_wheel;
+
+/* the idle check contexts of this worker */
+static ngx_queue_t  ngx_http_upstream_check_ctx_queue;
+
+/* the checks of this worker in flight and the peers waiting to start one */
+static ngx_uint_t   ngx_http_upstream_check_inflight;
+static ngx_uint_t   ngx_http_upstream_check_max_inflight_n;
+static ngx_queue_t  ngx_http_upstream_check_pending;
+
 
 ngx_uint_t
 ngx_http_upstream_check_add_peer(ngx_conf_t *cf,
@@ -886,43 +1602,227 @@ ngx_http_upstream_check_addr_change_port(ngx_pool_t *pool, ngx_addr_t *dst,
 ngx_uint_t
 ngx_http_upstream_check_peer_down(ngx_uint_t index)
 {
-    ngx_http_upstream_check_peer_t  *peer;
+    ngx_atomic_t  *map;
 
     if (check_peers_ctx == NULL || index >= check_peers_ctx->peers.nelts) {
         return 0;
     }
 
-    peer = check_peers_ctx->peers.elts;
+    map = check_peers_ctx->peers_shm->down_map;
 
-    return (peer[index].shm->down);
+    return (map[index / NGX_HTTP_CHECK_MAP_WORD_BITS]
+            >> (index % NGX_HTTP_CHECK_MAP_WORD_BITS)) & 1;
 }
 
 
-/* TODO: this interface can count each peer's busyness */
-void
-ngx_http_upstream_check_get_peer(ngx_uint_t index)
+ngx_msec_t
+ngx_http_upstream_check_peer_rtt(ngx_uint_t index)
 {
     ngx_http_upstream_check_peer_t  *peer;
 
     if (check_peers_ctx == NULL || index >= check_peers_ctx->peers.nelts) {
-        return;
+        return 0;
+    }
+
+    peer = check_peers_ctx->peers.elts;
+
+    return (ngx_msec_t) ((peer[index].shm->srtt + 3) >> 3);
+}
+
+
+ngx_uint_t
+ngx_http_upstream_check_peer_weight_factor(ngx_uint_t index)
+{
+    ngx_msec_t                       slow_start;
+    ngx_msec_int_t                   elapsed;
+    ngx_atomic_uint_t                recovered;
+    ngx_http_upstream_check_peer_t  *peer;
+
+    if (check_peers_ctx == NULL || index >= check_peers_ctx->peers.nelts) {
+        return NGX_HTTP_UPSTREAM_CHECK_WEIGHT_FACTOR;
     }
 
     peer = check_peers_ctx->peers.elts;
 
-    ngx_shmtx_lock(&peer[index].shm->mutex);
+    recovered = peer[index].shm->recovered;
+
+    if (recovered == 0) {
+        return NGX_HTTP_UPSTREAM_CHECK_WEIGHT_FACTOR;
+    }
+
+    /* the time of another worker may be ahead of the cached one */
+
+    elapsed = (ngx_msec_int_t) (ngx_current_msec - (ngx_msec_t) recovered);
+
+    if (elapsed < 0) {
+        elapsed = 0;
+    }
+
+    slow_start = peer[index].conf->slow_start;
+
+    if ((ngx_msec_t) elapsed >= slow_start) {
+
+        /* the ramp is over, spare the next calls the arithmetic */
+
+        (void) ngx_atomic_cmp_set(&peer[index].shm->recovered, recovered, 0);
+
+        return NGX_HTTP_UPSTREAM_CHECK_WEIGHT_FACTOR;
+    }
+
+    return (ngx_msec_t) elapsed * NGX_HTTP_UPSTREAM_CHECK_WEIGHT_FACTOR
+           / slow_start;
+}
+
+
+ngx_int_t
+ngx_http_upstream_check_slow_start_weight(ngx_uint_t index, ngx_int_t weight)
+{
+    ngx_uint_t  factor;
+
+    factor = ngx_http_upstream_check_peer_weight_factor(index);
+
+    if (factor == NGX_HTTP_UPSTREAM_CHECK_WEIGHT_FACTOR) {
+        return weight;
+    }
+
+    weight = weight * (ngx_int_t) factor
+             / NGX_HTTP_UPSTREAM_CHECK_WEIGHT_FACTOR;
+
+    return weight ? weight : 1;
+}
+
+
+ngx_int_t
+ngx_http_upstream_check_rtt_weight(ngx_uint_t index, ngx_int_t weight)
+{
+    ngx_msec_t  rtt;
+
+    rtt = ngx_http_upstream_check_peer_rtt(index);
+
+    weight = weight * NGX_HTTP_UPSTREAM_CHECK_RTT_SCALE
+             * NGX_HTTP_UPSTREAM_CHECK_RTT_BIAS
+             / (ngx_int_t) (NGX_HTTP_UPSTREAM_CHECK_RTT_BIAS + rtt);
+
+    return weight ? weight : 1;
+}
+
+
+uintptr_t
+ngx_http_upstream_check_peers_down_map(ngx_uint_t index, ngx_uint_t n,
+    ngx_uint_t *generation)
+{
+    uintptr_t                             down;
+    ngx_uint_t                            i, m, offset, number;
+    ngx_atomic_uint_t                     word;
+    ngx_http_upstream_check_peers_shm_t  *peers_shm;
+
+    if (check_peers_ctx == NULL) {
+        if (generation) {
+            *generation = 0;
+        }
+
+        return 0;
+    }
+
+    peers_shm = check_peers_ctx->peers_shm;
+
+    /* read before the bits, a caller may cache the result on it */
+    if (generation) {
+        *generation = peers_shm->map_generation;
+    }
+
+    number = check_peers_ctx->peers.nelts;
+
+    if (index >= number) {
+        return 0;
+    }
+
+    n = ngx_min(n, number - index);
+    n = ngx_min(n, NGX_HTTP_UPSTREAM_CHECK_MAP_BITS);
+
+    down = 0;
+
+    for (i = 0; i < n; i += m) {
+        offset = (index + i) % NGX_HTTP_CHECK_MAP_WORD_BITS;
+        word = peers_shm->down_map[(index + i) / NGX_HTTP_CHECK_MAP_WORD_BITS]
+               >> offset;
+
+        m = ngx_min(NGX_HTTP_CHECK_MAP_WORD_BITS - offset, n - i);
+
+        if (m < NGX_HTTP_CHECK_MAP_WORD_BITS) {
+            word &= ((ngx_atomic_uint_t) 1 << m) - 1;
+        }
+
+        down |= (uintptr_t) word << i;
+    }
+
+    return down;
+}
+
+
+ngx_uint_t
+ngx_http_upstream_check_peers_filter(ngx_uint_t *index, ngx_uint_t n,
+    uintptr_t *alive)
+{
+    ngx_uint_t     i, k, count, number;
+    ngx_atomic_t  *map;
+
+    ngx_memzero(alive, (n + NGX_HTTP_UPSTREAM_CHECK_MAP_BITS - 1)
+                       / NGX_HTTP_UPSTREAM_CHECK_MAP_BITS * sizeof(uintptr_t));
+
+    if (check_peers_ctx == NULL) {
+        number = 0;
+        map = NULL;
+
+    } else {
+        number = check_peers_ctx->peers.nelts;
+        map = check_peers_ctx->peers_shm->down_map;
+    }
+
+    count = 0;
+
+    for (i = 0; i < n; i++) {
+        k = index[i];
 
-    peer[index].shm->busyness++;
-    peer[index].shm->access_count++;
+        if (k < number
+            && ((map[k / NGX_HTTP_CHECK_MAP_WORD_BITS]
+                 >> (k % NGX_HTTP_CHECK_MAP_WORD_BITS)) & 1))
+        {
+            continue;
+        }
+
+        alive[i / NGX_HTTP_UPSTREAM_CHECK_MAP_BITS] |=
+            (uintptr_t) 1 << (i % NGX_HTTP_UPSTREAM_CHECK_MAP_BITS);
+        count++;
+    }
 
-    ngx_shmtx_unlock(&peer[index].shm->mutex);
+    return count;
 }
 
 
 void
-ngx_http_upstream_check_free_peer(ngx_uint_t index)
+ngx_http_upstream_check_get_peer(ngx_uint_t index)
 {
-    ngx_http_upstream_check_peer_t  *peer;
+    ngx_http_upstream_check_peer_stat_t  *stat;
+
+    if (check_peers_ctx == NULL || index >= check_peers_ctx->peers.nelts) {
+        return;
+    }
+
+    stat = &check_peers_ctx->peers_shm->stats[index];
+
+    (void) ngx_atomic_fetch_add(&stat->busyness, 1);
+    (void) ngx_atomic_fetch_add(&stat->access_count, 1);
+}
+
+
+void
+ngx_http_upstream_check_free_peer(ngx_uint_t index, ngx_uint_t status,
+    ngx_msec_t response_time)
+{
+    ngx_atomic_uint_t                     busyness;
+    ngx_http_upstream_check_peer_t       *peer;
+    ngx_http_upstream_check_peer_stat_t  *stat;
 
     if (check_peers_ctx == NULL || index >= check_peers_ctx->peers.nelts) {
         return;
@@ -930,20 +1830,124 @@ ngx_http_upstream_check_free_peer(ngx_uint_t index)
 
     peer = check_peers_ctx->peers.elts;
 
-    ngx_shmtx_lock(&peer[index].shm->mutex);
+    if (peer[index].conf->passive_fails
+        && (status >= NGX_HTTP_INTERNAL_SERVER_ERROR
+            || (peer[index].conf->passive_slow
+                && response_time >= peer[index].conf->passive_slow)))
+    {
+        ngx_http_upstream_check_passive_fail(&peer[index]);
+    }
+
+    stat = &check_peers_ctx->peers_shm->stats[index];
+
+    do {
+        busyness = stat->busyness;
+
+        if (busyness == 0) {
+            return;
+        }
+
+    } while (!ngx_atomic_cmp_set(&stat->busyness, busyness, busyness - 1));
+}
+
+
+static void
+ngx_http_upstream_check_passive_fail(ngx_http_upstream_check_peer_t *peer)
+{
+    ngx_uint_t                           i, fails;
+    ngx_msec_t                           slot_time;
+    ngx_atomic_uint_t                    epoch, old, slot;
+    ngx_http_upstream_check_peer_shm_t  *shm;
+
+    shm = peer->shm;
+
+    if (shm->down) {
+        return;
+    }
+
+    /*
+     * The window is split into slots, each one counts the failures of its
+     * part of the window and is recycled when the window has moved past it.
+     */
+
+    slot_time = peer->conf->passive_window / NGX_HTTP_CHECK_PASSIVE_SLOTS;
+    if (slot_time == 0) {
+        slot_time = 1;
+    }
+
+    epoch = (ngx_current_msec / slot_time) & NGX_HTTP_CHECK_PASSIVE_EPOCH_MASK;
+    i = epoch % NGX_HTTP_CHECK_PASSIVE_SLOTS;
+
+    do {
+        old = shm->passive_slots[i];
+
+        if (old >> NGX_HTTP_CHECK_PASSIVE_COUNT_BITS != epoch) {
+            slot = (epoch << NGX_HTTP_CHECK_PASSIVE_COUNT_BITS) | 1;
+
+        } else if ((old & NGX_HTTP_CHECK_PASSIVE_COUNT_MASK)
+                   == NGX_HTTP_CHECK_PASSIVE_COUNT_MASK)
+        {
+            break;
+
+        } else {
+            slot = old + 1;
+        }
+
+    } while (!ngx_atomic_cmp_set(&shm->passive_slots[i], old, slot));
+
+    fails = 0;
+
+    for (i = 0; i < NGX_HTTP_CHECK_PASSIVE_SLOTS; i++) {
+        slot = shm->passive_slots[i];
+
+        if (((epoch - (slot >> NGX_HTTP_CHECK_PASSIVE_COUNT_BITS))
+             & NGX_HTTP_CHECK_PASSIVE_EPOCH_MASK)
+            < NGX_HTTP_CHECK_PASSIVE_SLOTS)
+        {
+            fails += slot & NGX_HTTP_CHECK_PASSIVE_COUNT_MASK;
+        }
+    }
+
+    if (fails < peer->conf->passive_fails) {
+        return;
+    }
+
+    /*
+     * The check owner resets the rise count and the interval, the active
+     * checks then bring the peer back after rise successes.
+     */
+
+    ngx_shmtx_lock(&shm->mutex);
+
+    if (shm->down) {
+        ngx_shmtx_unlock(&shm->mutex);
+        return;
+    }
+
+    shm->down = 1;
+    shm->passive_down = 1;
+
+    ngx_http_upstream_check_map_set_peer(peer, 1);
 
-    if (peer[index].shm->busyness > 0) {
-        peer[index].shm->busyness--;
+    ngx_shmtx_unlock(&shm->mutex);
+
+    for (i = 0; i < NGX_HTTP_CHECK_PASSIVE_SLOTS; i++) {
+        do {
+            old = shm->passive_slots[i];
+        } while (!ngx_atomic_cmp_set(&shm->passive_slots[i], old, 0));
     }
 
-    ngx_shmtx_unlock(&peer[index].shm->mutex);
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "disable check peer: %V, %ui failed responses",
+                  &peer->check_peer_addr->name, fails);
 }
 
 
 static ngx_int_t
 ngx_http_upstream_check_add_timers(ngx_cycle_t *cycle)
 {
-    ngx_uint_t                           i;
+    uint64_t                             key;
+    ngx_uint_t                           i, shards;
     ngx_msec_t                           t, delay;
     ngx_check_conf_t                    *cf;
     ngx_http_upstream_check_peer_t      *peer;
@@ -951,6 +1955,13 @@ ngx_http_upstream_check_add_timers(ngx_cycle_t *cycle)
     ngx_http_upstream_check_srv_conf_t  *ucscf;
     ngx_http_upstream_check_peer_shm_t  *peer_shm;
     ngx_http_upstream_check_peers_shm_t *peers_shm;
+    ngx_http_upstream_check_main_conf_t *ucmcf;
+#if (nginx_version >= 1009001)
+    ngx_core_conf_t                     *ccf;
+#endif
+
+    ngx_queue_init(&ngx_http_upstream_check_ctx_queue);
+    ngx_queue_init(&ngx_http_upstream_check_pending);
 
     peers = check_peers_ctx;
     if (peers == NULL) {
@@ -970,16 +1981,57 @@ ngx_http_upstream_check_add_timers(ngx_cycle_t *cycle)
 
     srandom(ngx_pid);
 
+    ngx_http_upstream_check_wheel_init(cycle);
+
+    shards = 0;
+
+    ucmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                                ngx_http_upstream_check_module);
+
+    ngx_http_upstream_check_max_inflight_n = ucmcf->check_max_inflight;
+
+#if (nginx_version >= 1009001)
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    if (ucmcf->check_shard && ccf->worker_processes > 1) {
+        shards = ccf->worker_processes;
+    }
+#endif
+
     peer = peers->peers.elts;
     peer_shm = peers_shm->peers;
 
     for (i = 0; i < peers->peers.nelts; i++) {
+
+        if (peer[i].primary) {
+
+            /* checked through the primary, it is not scheduled */
+
+            peer[i].shm = &peer_shm[peer[i].primary->index];
+            continue;
+        }
+
         peer[i].shm = &peer_shm[i];
 
         peer[i].check_ev.handler = ngx_http_upstream_check_begin_handler;
         peer[i].check_ev.log = cycle->log;
         peer[i].check_ev.data = &peer[i];
         peer[i].check_ev.timer_set = 0;
+        peer[i].wheel_set = 0;
+
+        if (shards) {
+            key = (uint64_t) ngx_murmur_hash2(peer[i].upstream_name->data,
+                                              peer[i].upstream_name->len) << 32
+                  | ngx_murmur_hash2(peer[i].check_peer_addr->name.data,
+                                     peer[i].check_peer_addr->name.len);
+
+            peer[i].shard = (ngx_http_upstream_check_shard_hash(key, shards)
+                             == ngx_worker) ? NGX_HTTP_CHECK_SHARD_OWN
+                                            : NGX_HTTP_CHECK_SHARD_OTHER;
+
+        } else {
+            peer[i].shard = NGX_HTTP_CHECK_SHARD_OFF;
+        }
 
         peer[i].check_timeout_ev.handler =
             ngx_http_upstream_check_timeout_handler;
@@ -990,13 +2042,6 @@ ngx_http_upstream_check_add_timers(ngx_cycle_t *cycle)
         ucscf = peer[i].conf;
         cf = ucscf->check_type_conf;
 
-        if (cf->need_pool) {
-            peer[i].pool = ngx_create_pool(ngx_pagesize, cycle->log);
-            if (peer[i].pool == NULL) {
-                return NGX_ERROR;
-            }
-        }
-
         peer[i].send_handler = cf->send_handler;
         peer[i].recv_handler = cf->recv_handler;
 
@@ -1007,119 +2052,372 @@ ngx_http_upstream_check_add_timers(ngx_cycle_t *cycle)
         /*
          * We add a random start time here, since we don't want to trigger
          * the check events too close to each other at the beginning.
+         * A peer in its fast start is only spread over a short while,
+         * check_max_inflight is what limits such a burst.
          */
-        delay = ucscf->check_interval > 1000 ? ucscf->check_interval : 1000;
+        if (peer[i].shm->fast_start) {
+            delay = NGX_HTTP_CHECK_FAST_START_INTERVAL;
+
+        } else {
+            delay = ucscf->check_interval > 1000 ? ucscf->check_interval
+                                                 : 1000;
+        }
+
         t = ngx_random() % delay;
 
-        ngx_add_timer(&peer[i].check_ev, t);
+        ngx_http_upstream_check_wheel_add(&peer[i], t);
     }
 
+    ngx_add_timer(&ngx_http_upstream_check_wheel.event,
+                  NGX_HTTP_CHECK_WHEEL_TICK);
+
     return NGX_OK;
 }
 
 
-static void
-ngx_http_upstream_check_begin_handler(ngx_event_t *event)
+/*
+ * Jump consistent hash (Lamping and Veach), a change of the worker number
+ * only moves the peers of the added or removed workers.
+ */
+
+static ngx_uint_t
+ngx_http_upstream_check_shard_hash(uint64_t key, ngx_uint_t buckets)
 {
-    ngx_msec_t                           interval;
-    ngx_http_upstream_check_peer_t      *peer;
-    ngx_http_upstream_check_peers_t     *peers;
-    ngx_http_upstream_check_srv_conf_t  *ucscf;
-    ngx_http_upstream_check_peers_shm_t *peers_shm;
+    int64_t  b, j;
 
-    if (ngx_http_upstream_check_need_exit()) {
-        return;
+    b = -1;
+    j = 0;
+
+    while (j < (int64_t) buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (int64_t) ((b + 1) * ((double) (1LL << 31)
+                                  / (double) ((key >> 33) + 1)));
     }
 
-    peers = check_peers_ctx;
-    if (peers == NULL) {
-        return;
+    return (ngx_uint_t) b;
+}
+
+
+static void
+ngx_http_upstream_check_wheel_init(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_check_wheel_t  *wheel;
+
+    wheel = &ngx_http_upstream_check_wheel;
+
+    for (i = 0; i < NGX_HTTP_CHECK_WHEEL_SIZE; i++) {
+        ngx_queue_init(&wheel->inner[i]);
     }
 
-    peers_shm = peers->peers_shm;
-    if (peers_shm == NULL) {
-        return;
+    for (i = 0; i < NGX_HTTP_CHECK_WHEEL_OUTER_SIZE; i++) {
+        ngx_queue_init(&wheel->outer[i]);
     }
 
-    peer = event->data;
-    ucscf = peer->conf;
+    wheel->tick = 0;
+    wheel->time = ngx_current_msec;
 
-    ngx_add_timer(event, ucscf->check_interval / 2);
+    wheel->event.handler = ngx_http_upstream_check_wheel_handler;
+    wheel->event.log = cycle->log;
+    wheel->event.data = wheel;
+    wheel->event.timer_set = 0;
+}
 
-    /* This process is processing this peer now. */
-    if ((peer->shm->owner == ngx_pid  ||
-        (peer->pc.connection != NULL) ||
-        peer->check_timeout_ev.timer_set)) {
-        return;
-    }    
 
-    interval = ngx_current_msec - peer->shm->access_time;
-    ngx_log_debug5(NGX_LOG_DEBUG_HTTP, event->log, 0,
-                   "http check begin handler index: %ui, owner: %P, "
-                   "ngx_pid: %P, interval: %M, check_interval: %M",
-                   peer->index, peer->shm->owner,
-                   ngx_pid, interval,
-                   ucscf->check_interval);
+static void
+ngx_http_upstream_check_wheel_add(ngx_http_upstream_check_peer_t *peer,
+    ngx_msec_t delay)
+{
+    ngx_uint_t                        ticks;
+    ngx_http_upstream_check_wheel_t  *wheel;
 
-    ngx_shmtx_lock(&peer->shm->mutex);
+    wheel = &ngx_http_upstream_check_wheel;
 
-    if (peers_shm->generation != ngx_http_upstream_check_shm_generation) {
-        ngx_shmtx_unlock(&peer->shm->mutex);
-        return;
+    if (peer->wheel_set) {
+        ngx_queue_remove(&peer->wheel_queue);
     }
 
-    if ((interval >= ucscf->check_interval)
-         && (peer->shm->owner == NGX_INVALID_PID))
-    {
-        peer->shm->owner = ngx_pid;
-
-    } else if (interval >= (ucscf->check_interval << 4)) {
-
-        /*
-         * If the check peer has been untouched for 2^4 times of
-         * the check interval, activate the current timer.
-         * Sometimes, the checking process may disappear
-         * in some circumstances, and the clean event will never
-         * be triggered.
-         */
-        peer->shm->owner = ngx_pid;
-        peer->shm->access_time = ngx_current_msec;
+    ticks = (delay + NGX_HTTP_CHECK_WHEEL_TICK - 1) / NGX_HTTP_CHECK_WHEEL_TICK;
+    if (ticks == 0) {
+        ticks = 1;
     }
 
-    ngx_shmtx_unlock(&peer->shm->mutex);
+    peer->wheel_expire = wheel->tick + ticks;
+    peer->wheel_set = 1;
 
-    if (peer->shm->owner == ngx_pid) {
-        ngx_http_upstream_check_connect_handler(event);
-    }
+    ngx_http_upstream_check_wheel_insert(wheel, peer);
 }
 
 
 static void
-ngx_http_upstream_check_connect_handler(ngx_event_t *event)
+ngx_http_upstream_check_wheel_insert(ngx_http_upstream_check_wheel_t *wheel,
+    ngx_http_upstream_check_peer_t *peer)
 {
-    ngx_int_t                            rc;
-    ngx_connection_t                    *c;
-    ngx_http_upstream_check_peer_t      *peer;
-    ngx_http_upstream_check_srv_conf_t  *ucscf;
+    ngx_uint_t  ticks, slot;
 
-    if (ngx_http_upstream_check_need_exit()) {
+    ticks = peer->wheel_expire - wheel->tick;
+
+    if (ticks < NGX_HTTP_CHECK_WHEEL_SIZE) {
+        slot = peer->wheel_expire & NGX_HTTP_CHECK_WHEEL_MASK;
+        ngx_queue_insert_tail(&wheel->inner[slot], &peer->wheel_queue);
         return;
     }
 
-    peer = event->data;
-    ucscf = peer->conf;
+    if ((ticks >> NGX_HTTP_CHECK_WHEEL_BITS)
+        < NGX_HTTP_CHECK_WHEEL_OUTER_SIZE)
+    {
+        slot = peer->wheel_expire >> NGX_HTTP_CHECK_WHEEL_BITS;
 
-    if (peer->pc.connection != NULL) {
-        c = peer->pc.connection;
+    } else {
+        /* park it in the farthest slot, it will be cascaded once more */
+        slot = (wheel->tick >> NGX_HTTP_CHECK_WHEEL_BITS)
+               + NGX_HTTP_CHECK_WHEEL_OUTER_SIZE - 1;
+    }
+
+    slot &= NGX_HTTP_CHECK_WHEEL_OUTER_MASK;
+
+    ngx_queue_insert_tail(&wheel->outer[slot], &peer->wheel_queue);
+}
+
+
+static void
+ngx_http_upstream_check_wheel_handler(ngx_event_t *event)
+{
+    ngx_uint_t                        slot;
+    ngx_queue_t                      *q, expired;
+    ngx_http_upstream_check_peer_t   *peer;
+    ngx_http_upstream_check_wheel_t  *wheel;
+
+    if (ngx_http_upstream_check_need_exit()) {
+        return;
+    }
+
+    wheel = event->data;
+
+    while ((ngx_msec_int_t) (ngx_current_msec - wheel->time)
+           >= NGX_HTTP_CHECK_WHEEL_TICK)
+    {
+        wheel->time += NGX_HTTP_CHECK_WHEEL_TICK;
+        wheel->tick++;
+
+        if ((wheel->tick & NGX_HTTP_CHECK_WHEEL_MASK) == 0) {
+
+            slot = (wheel->tick >> NGX_HTTP_CHECK_WHEEL_BITS)
+                   & NGX_HTTP_CHECK_WHEEL_OUTER_MASK;
+
+            ngx_queue_init(&expired);
+
+            if (!ngx_queue_empty(&wheel->outer[slot])) {
+                ngx_queue_add(&expired, &wheel->outer[slot]);
+                ngx_queue_init(&wheel->outer[slot]);
+            }
+
+            while (!ngx_queue_empty(&expired)) {
+                q = ngx_queue_head(&expired);
+                ngx_queue_remove(q);
+
+                peer = ngx_queue_data(q, ngx_http_upstream_check_peer_t,
+                                      wheel_queue);
+
+                ngx_http_upstream_check_wheel_insert(wheel, peer);
+            }
+        }
+
+        slot = wheel->tick & NGX_HTTP_CHECK_WHEEL_MASK;
+
+        if (ngx_queue_empty(&wheel->inner[slot])) {
+            continue;
+        }
+
+        /* the handlers put the peers back onto the wheel */
+
+        ngx_queue_init(&expired);
+        ngx_queue_add(&expired, &wheel->inner[slot]);
+        ngx_queue_init(&wheel->inner[slot]);
+
+        while (!ngx_queue_empty(&expired)) {
+            q = ngx_queue_head(&expired);
+            ngx_queue_remove(q);
+
+            peer = ngx_queue_data(q, ngx_http_upstream_check_peer_t,
+                                  wheel_queue);
+            peer->wheel_set = 0;
+
+            peer->check_ev.handler(&peer->check_ev);
+        }
+    }
+
+    if (ngx_http_upstream_check_need_exit()) {
+        return;
+    }
+
+    ngx_add_timer(event, NGX_HTTP_CHECK_WHEEL_TICK
+                         - (ngx_current_msec - wheel->time));
+}
+
+
+static void
+ngx_http_upstream_check_begin_handler(ngx_event_t *event)
+{
+    ngx_msec_t                           interval, delay, check_interval;
+    ngx_http_upstream_check_peer_t      *peer;
+    ngx_http_upstream_check_peers_t     *peers;
+    ngx_http_upstream_check_peers_shm_t *peers_shm;
+
+    if (ngx_http_upstream_check_need_exit()) {
+        return;
+    }
+
+    peers = check_peers_ctx;
+    if (peers == NULL) {
+        return;
+    }
+
+    peers_shm = peers->peers_shm;
+    if (peers_shm == NULL) {
+        return;
+    }
+
+    peer = event->data;
+
+    check_interval = ngx_http_upstream_check_peer_interval(peer);
+
+    switch (peer->shard) {
+
+    case NGX_HTTP_CHECK_SHARD_OWN:
+        delay = check_interval;
+        break;
+
+    case NGX_HTTP_CHECK_SHARD_OTHER:
+        /* only look for a dead owner */
+        delay = check_interval << 2;
+        break;
+
+    default:
+        delay = check_interval / 2;
+        break;
+    }
+
+    ngx_http_upstream_check_wheel_add(peer, delay);
+
+    if (peer->pending) {
+        /* still owned while it waits, keep the others from taking it over */
+        peer->shm->access_time = ngx_current_msec;
+        return;
+    }
+
+    /* This process is processing this peer now. */
+    if ((peer->shm->owner == ngx_pid  ||
+        (peer->pc.connection != NULL) ||
+        peer->check_timeout_ev.timer_set)) {
+        return;
+    }    
+
+    interval = ngx_current_msec - peer->shm->access_time;
+
+    if (peer->shard != NGX_HTTP_CHECK_SHARD_OFF
+        && interval < (check_interval << 4))
+    {
+        /*
+         * The peer belongs to exactly one worker, no need to race for it.
+         * The others only take it over with the lock below when its owner
+         * has not touched it for 2^4 times of the check interval.
+         */
+
+        if (peer->shard == NGX_HTTP_CHECK_SHARD_OTHER
+            || peer->shm->owner != NGX_INVALID_PID
+            || peers_shm->generation != ngx_http_upstream_check_shm_generation)
+        {
+            return;
+        }
+
+        peer->shm->owner = ngx_pid;
+
+        ngx_http_upstream_check_connect_handler(event);
+        return;
+    }
+    ngx_log_debug5(NGX_LOG_DEBUG_HTTP, event->log, 0,
+                   "http check begin handler index: %ui, owner: %P, "
+                   "ngx_pid: %P, interval: %M, check_interval: %M",
+                   peer->index, peer->shm->owner,
+                   ngx_pid, interval,
+                   check_interval);
+
+    ngx_shmtx_lock(&peer->shm->mutex);
+
+    if (peers_shm->generation != ngx_http_upstream_check_shm_generation) {
+        ngx_shmtx_unlock(&peer->shm->mutex);
+        return;
+    }
+
+    /* another worker may have just taken it over */
+    interval = ngx_current_msec - peer->shm->access_time;
+
+    if ((interval >= check_interval)
+         && (peer->shm->owner == NGX_INVALID_PID))
+    {
+        peer->shm->owner = ngx_pid;
+
+    } else if (interval >= (check_interval << 4)) {
+
+        /*
+         * If the check peer has been untouched for 2^4 times of
+         * the check interval, activate the current timer.
+         * Sometimes, the checking process may disappear
+         * in some circumstances, and the clean event will never
+         * be triggered.
+         */
+        peer->shm->owner = ngx_pid;
+        peer->shm->access_time = ngx_current_msec;
+    }
+
+    ngx_shmtx_unlock(&peer->shm->mutex);
+
+    if (peer->shm->owner == ngx_pid) {
+        ngx_http_upstream_check_connect_handler(event);
+    }
+}
+
+
+static void
+ngx_http_upstream_check_connect_handler(ngx_event_t *event)
+{
+    ngx_int_t                            rc;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_check_peer_t      *peer;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    if (ngx_http_upstream_check_need_exit()) {
+        return;
+    }
+
+    peer = event->data;
+    ucscf = peer->conf;
+
+    if (ngx_http_upstream_check_inflight_acquire(peer) != NGX_OK) {
+        return;
+    }
+
+    peer->check_start = ngx_current_msec;
+    peer->phase_start = ngx_current_msec;
+
+    if (peer->pc.connection != NULL) {
+        c = peer->pc.connection;
         if ((rc = ngx_http_upstream_check_peek_one_byte(c)) == NGX_OK) {
+
+            /* nothing to time for a kept alive connection */
+            peer->phase = NGX_HTTP_CHECK_PHASE_SEND;
+
             goto upstream_check_connect_done;
         } else {
-            ngx_close_connection(c);
-            peer->pc.connection = NULL;
+            ngx_http_upstream_check_close_connection(peer);
         }
     }
     ngx_memzero(&peer->pc, sizeof(ngx_peer_connection_t));
 
+    peer->phase = NGX_HTTP_CHECK_PHASE_CONNECT;
+
     peer->pc.sockaddr = peer->check_peer_addr->sockaddr;
     peer->pc.socklen = peer->check_peer_addr->socklen;
     peer->pc.name = &peer->check_peer_addr->name;
@@ -1146,11 +2444,29 @@ ngx_http_upstream_check_connect_handler(ngx_event_t *event)
     c->sendfile = 0;
     c->read->log = c->log;
     c->write->log = c->log;
-    c->pool = peer->pool;
 
 upstream_check_connect_done:
     peer->state = NGX_HTTP_CHECK_CONNECT_DONE;
 
+    if (ucscf->check_type_conf->need_pool) {
+
+        /* a kept alive connection still holds its context */
+
+        if (peer->check_data == NULL
+            && ngx_http_upstream_check_ctx_get(peer) != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                          "check init error with peer: %V ",
+                          &peer->check_peer_addr->name);
+
+            c->error = 1;
+            ngx_http_upstream_check_clean_event(peer);
+            return;
+        }
+
+        c->pool = ((ngx_http_upstream_check_ctx_t *) peer->check_data)->pool;
+    }
+
     c->write->handler = peer->send_handler;
     c->read->handler = peer->recv_handler;
 
@@ -1196,6 +2512,8 @@ ngx_http_upstream_check_peek_handler(ngx_event_t *event)
     c = event->data;
     peer = c->data;
 
+    ngx_http_upstream_check_phase_done(peer, NGX_HTTP_CHECK_PHASE_CONNECT);
+
     if (ngx_http_upstream_check_peek_one_byte(c) == NGX_OK) {
         ngx_http_upstream_check_status_update(peer, 1);
         // the TCP channel counts as one request if the connection is normal.
@@ -1230,22 +2548,35 @@ ngx_http_upstream_check_discard_handler(ngx_event_t *event)
 
     peer = c->data;
 
-    while (1) {
-        size = c->recv(c, buf, 4096);
+    /* the frames of an http2 connection are kept for the next check */
 
-        if (size > 0) {
-            continue;
+    if (peer->conf->check_type_conf->type
+        & (NGX_HTTP_CHECK_GRPC|NGX_HTTP_CHECK_GRPCS))
+    {
+        if (ngx_http_upstream_check_grpc_read(peer) != NGX_OK) {
+            goto check_discard_fail;
+        }
 
-        } else if (size == NGX_AGAIN) {
-            break;
+    } else {
 
-        } else {
-            if (size == 0) {
-                ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                               "peer closed its half side of the connection");
-            }
+        while (1) {
+            size = c->recv(c, buf, 4096);
 
-            goto check_discard_fail;
+            if (size > 0) {
+                continue;
+
+            } else if (size == NGX_AGAIN) {
+                break;
+
+            } else {
+                if (size == 0) {
+                    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                                   "peer closed its half side of the "
+                                   "connection");
+                }
+
+                goto check_discard_fail;
+            }
         }
     }
 
@@ -1269,66 +2600,317 @@ ngx_http_upstream_check_dummy_handler(ngx_event_t *event)
 
 
 static void
-ngx_http_upstream_check_send_handler(ngx_event_t *event)
+ngx_http_upstream_check_close_connection(ngx_http_upstream_check_peer_t *peer)
 {
-    ssize_t                         size;
-    ngx_connection_t               *c;
-    ngx_http_upstream_check_ctx_t  *ctx;
-    ngx_http_upstream_check_peer_t *peer;
-
-    if (ngx_http_upstream_check_need_exit()) {
-        return;
-    }
-
-    c = event->data;
-    peer = c->data;
+    ngx_connection_t  *c;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http check send.");
+    c = peer->pc.connection;
 
-    if (c->pool == NULL) {
-        ngx_log_error(NGX_LOG_ERR, event->log, 0,
-                      "check pool NULL with peer: %V ",
-                      &peer->check_peer_addr->name);
+#if (NGX_HTTP_SSL)
 
-        goto check_send_fail;
+    if (c->ssl) {
+        c->ssl->no_wait_shutdown = 1;
+        (void) ngx_ssl_shutdown(c);
     }
 
-    if (peer->state != NGX_HTTP_CHECK_CONNECT_DONE) {
-        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+#endif
 
-            ngx_log_error(NGX_LOG_ERR, event->log, 0,
-                          "check handle write event error with peer: %V ",
-                          &peer->check_peer_addr->name);
+    ngx_close_connection(c);
+    peer->pc.connection = NULL;
+}
 
-            goto check_send_fail;
-        }
 
-        return;
-    }
+#if (NGX_HTTP_SSL)
 
-    if (peer->check_data == NULL) {
+static void
+ngx_http_upstream_check_ssl_handshake(ngx_http_upstream_check_peer_t *peer)
+{
+    ngx_int_t                            rc;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_check_ctx_t       *ctx;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
 
-        peer->check_data = ngx_pcalloc(peer->pool,
-                                       sizeof(ngx_http_upstream_check_ctx_t));
-        if (peer->check_data == NULL) {
-            goto check_send_fail;
-        }
+    c = peer->pc.connection;
+    ucscf = peer->conf;
 
-        if (peer->init == NULL || peer->init(peer) != NGX_OK) {
+    if (ngx_ssl_create_connection(ucscf->ssl, c, NGX_SSL_CLIENT) != NGX_OK) {
+        goto failed;
+    }
 
-            ngx_log_error(NGX_LOG_ERR, event->log, 0,
-                          "check init error with peer: %V ",
-                          &peer->check_peer_addr->name);
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
 
-            goto check_send_fail;
-        }
+    if (ucscf->ssl_name.len
+        && SSL_set_tlsext_host_name(c->ssl->connection,
+                                    (char *) ucscf->ssl_name.data)
+           == 0)
+    {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "check ssl set server name \"%V\" failed "
+                      "with peer: %V ",
+                      &ucscf->ssl_name, &peer->check_peer_addr->name);
+
+        goto failed;
     }
 
-    ctx = peer->check_data;
+#endif
 
-    while (ctx->send.pos < ctx->send.last) {
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
 
-        size = c->send(c, ctx->send.pos, ctx->send.last - ctx->send.pos);
+    if (ucscf->check_type_conf->type == NGX_HTTP_CHECK_GRPCS
+        && SSL_set_alpn_protos(c->ssl->connection,
+                               (const unsigned char *) "\x02h2", 3)
+           != 0)
+    {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "check ssl set alpn \"h2\" failed with peer: %V ",
+                      &peer->check_peer_addr->name);
+
+        goto failed;
+    }
+
+#endif
+
+    c->ssl->save_session = ngx_http_upstream_check_ssl_save_session;
+
+    if (peer->ssl_session
+        && ngx_ssl_set_session(c, peer->ssl_session) != NGX_OK)
+    {
+        goto failed;
+    }
+
+    ctx = peer->check_data;
+    ctx->reset_pool = 1;
+
+    rc = ngx_ssl_handshake(c);
+
+    if (rc == NGX_AGAIN) {
+        c->ssl->handler = ngx_http_upstream_check_ssl_handshake_handler;
+        return;
+    }
+
+    ngx_http_upstream_check_ssl_handshake_handler(c);
+    return;
+
+failed:
+
+    c->error = 1;
+    ngx_http_upstream_check_status_update(peer, 0);
+    ngx_http_upstream_check_clean_event(peer);
+}
+
+
+static void
+ngx_http_upstream_check_ssl_handshake_handler(ngx_connection_t *c)
+{
+    long                                 rc;
+    ngx_str_t                           *name;
+    ngx_http_upstream_check_ctx_t       *ctx;
+    ngx_http_upstream_check_peer_t      *peer;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    peer = c->data;
+    ucscf = peer->conf;
+
+    if (!c->ssl->handshaked) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "check ssl handshake failed with peer: %V ",
+                      &peer->check_peer_addr->name);
+
+        goto failed;
+    }
+
+    if (ucscf->ssl_verify) {
+        rc = SSL_get_verify_result(c->ssl->connection);
+
+        if (rc != X509_V_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "check ssl certificate verify error: (%l:%s) "
+                          "with peer: %V ",
+                          rc, X509_verify_cert_error_string(rc),
+                          &peer->check_peer_addr->name);
+
+            goto verify_failed;
+        }
+
+        name = ucscf->ssl_name.len ? &ucscf->ssl_name : peer->upstream_name;
+
+        if (ngx_ssl_check_host(c, name) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "check ssl certificate does not match \"%V\" "
+                          "with peer: %V ",
+                          name, &peer->check_peer_addr->name);
+
+            goto verify_failed;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http check ssl handshake done, reused: %d, peer: %V ",
+                   SSL_session_reused(c->ssl->connection),
+                   &peer->check_peer_addr->name);
+
+    c->write->handler = peer->send_handler;
+    c->read->handler = peer->recv_handler;
+
+    ctx = peer->check_data;
+
+    if (ctx->send.pos == ctx->send.last) {
+
+        /* nothing to send, the handshake is the check */
+
+        c->requests++;
+
+        ngx_http_upstream_check_status_update(peer, 1);
+
+        peer->state = NGX_HTTP_CHECK_RECV_DONE;
+
+#ifdef TLS1_3_VERSION
+
+        /*
+         * The session tickets of TLSv1.3 come after the handshake, they
+         * are read until the check timeout for the next check to resume.
+         */
+
+        if (SSL_version(c->ssl->connection) == TLS1_3_VERSION) {
+            c->write->handler = ngx_http_upstream_check_dummy_handler;
+            c->read->handler = ngx_http_upstream_check_ssl_ticket_handler;
+
+            if (c->read->ready) {
+                c->read->handler(c->read);
+                return;
+            }
+
+            if (ngx_handle_read_event(c->read, 0) == NGX_OK) {
+                return;
+            }
+        }
+
+#endif
+
+        ngx_http_upstream_check_clean_event(peer);
+        return;
+    }
+
+    c->write->handler(c->write);
+    return;
+
+verify_failed:
+
+    /* a session of TLSv1.2 is saved within the handshake already */
+
+    if (peer->ssl_session) {
+        ngx_ssl_free_session(peer->ssl_session);
+        peer->ssl_session = NULL;
+    }
+
+failed:
+
+    c->error = 1;
+    ngx_http_upstream_check_status_update(peer, 0);
+    ngx_http_upstream_check_clean_event(peer);
+}
+
+
+static void
+ngx_http_upstream_check_ssl_ticket_handler(ngx_event_t *event)
+{
+    u_char                           buf[1];
+    ngx_connection_t                *c;
+    ngx_http_upstream_check_peer_t  *peer;
+
+    if (ngx_http_upstream_check_need_exit()) {
+        return;
+    }
+
+    c = event->data;
+    peer = c->data;
+
+    /* the read processes the tickets, the server sends no data */
+
+    (void) c->recv(c, buf, 1);
+
+    ngx_http_upstream_check_clean_event(peer);
+}
+
+
+static void
+ngx_http_upstream_check_ssl_save_session(ngx_connection_t *c)
+{
+    ngx_ssl_session_t               *session;
+    ngx_http_upstream_check_peer_t  *peer;
+
+    /* called by the client session cache for each new session or ticket */
+
+    peer = c->data;
+
+    session = ngx_ssl_get_session(c);
+    if (session == NULL) {
+        return;
+    }
+
+    if (peer->ssl_session) {
+        ngx_ssl_free_session(peer->ssl_session);
+    }
+
+    peer->ssl_session = session;
+}
+
+#endif
+
+
+static void
+ngx_http_upstream_check_send_handler(ngx_event_t *event)
+{
+    ssize_t                         size;
+    ngx_connection_t               *c;
+    ngx_http_upstream_check_ctx_t  *ctx;
+    ngx_http_upstream_check_peer_t *peer;
+
+    if (ngx_http_upstream_check_need_exit()) {
+        return;
+    }
+
+    c = event->data;
+    peer = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http check send.");
+
+    if (c->pool == NULL) {
+        ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                      "check pool NULL with peer: %V ",
+                      &peer->check_peer_addr->name);
+
+        goto check_send_fail;
+    }
+
+    if (peer->state != NGX_HTTP_CHECK_CONNECT_DONE) {
+        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+
+            ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                          "check handle write event error with peer: %V ",
+                          &peer->check_peer_addr->name);
+
+            goto check_send_fail;
+        }
+
+        return;
+    }
+
+    /* the first write event reports the connection established */
+    ngx_http_upstream_check_phase_done(peer, NGX_HTTP_CHECK_PHASE_CONNECT);
+
+#if (NGX_HTTP_SSL)
+    if (peer->conf->ssl && c->ssl == NULL) {
+        ngx_http_upstream_check_ssl_handshake(peer);
+        return;
+    }
+#endif
+
+    ctx = peer->check_data;
+
+    while (ctx->send.pos < ctx->send.last) {
+
+        size = c->send(c, ctx->send.pos, ctx->send.last - ctx->send.pos);
 
 #if (NGX_DEBUG)
         {
@@ -1355,6 +2937,8 @@ ngx_http_upstream_check_send_handler(ngx_event_t *event)
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http check send done.");
         peer->state = NGX_HTTP_CHECK_SEND_DONE;
         c->requests++;
+
+        ngx_http_upstream_check_phase_done(peer, NGX_HTTP_CHECK_PHASE_SEND);
     }
 
     return;
@@ -1368,12 +2952,12 @@ check_send_fail:
 static void
 ngx_http_upstream_check_recv_handler(ngx_event_t *event)
 {
-    u_char                         *new_buf;
-    ssize_t                         size, n;
-    ngx_int_t                       rc;
-    ngx_connection_t               *c;
-    ngx_http_upstream_check_ctx_t  *ctx;
-    ngx_http_upstream_check_peer_t *peer;
+    size_t                               buffer_size;
+    ssize_t                              size, n;
+    ngx_int_t                            rc;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_check_ctx_t       *ctx;
+    ngx_http_upstream_check_peer_t      *peer;
 
     if (ngx_http_upstream_check_need_exit()) {
         return;
@@ -1392,34 +2976,45 @@ ngx_http_upstream_check_recv_handler(ngx_event_t *event)
     }
 
     ctx = peer->check_data;
+    buffer_size = peer->conf->check_buffer_size;
 
-    if (ctx->recv.start == NULL) {
-        /* 1/2 of the page_size, is it enough? */
-        ctx->recv.start = ngx_palloc(c->pool, ngx_pagesize / 2);
+    /* a borrowed context may carry a buffer of another upstream */
+
+    if (ctx->recv.start == NULL
+        || (size_t) (ctx->recv.end - ctx->recv.start) != buffer_size)
+    {
+        ctx->recv.start = ngx_palloc(c->pool, buffer_size);
         if (ctx->recv.start == NULL) {
             goto check_recv_fail;
         }
 
         ctx->recv.last = ctx->recv.pos = ctx->recv.start;
-        ctx->recv.end = ctx->recv.start + ngx_pagesize / 2;
+        ctx->recv.end = ctx->recv.start + buffer_size;
     }
 
+    rc = NGX_AGAIN;
+
     while (1) {
         n = ctx->recv.end - ctx->recv.last;
 
-        /* buffer not big enough? enlarge it by twice */
+        /* the buffer is full, keep the bytes not parsed yet */
         if (n == 0) {
-            size = ctx->recv.end - ctx->recv.start;
-            new_buf = ngx_palloc(c->pool, size * 2);
-            if (new_buf == NULL) {
+            size = ctx->recv.last - ctx->recv.pos;
+
+            if (size == (ssize_t) buffer_size) {
+                ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                              "check response exceeds check_buffer_size "
+                              "with peer: %V ",
+                              &peer->check_peer_addr->name);
+
+                c->error = 1;
                 goto check_recv_fail;
             }
 
-            ngx_memcpy(new_buf, ctx->recv.start, size);
+            ngx_memmove(ctx->recv.start, ctx->recv.pos, size);
 
-            ctx->recv.pos = ctx->recv.start = new_buf;
-            ctx->recv.last = new_buf + size;
-            ctx->recv.end = new_buf + size * 2;
+            ctx->recv.pos = ctx->recv.start;
+            ctx->recv.last = ctx->recv.start + size;
 
             n = ctx->recv.end - ctx->recv.last;
         }
@@ -1439,7 +3034,24 @@ ngx_http_upstream_check_recv_handler(ngx_event_t *event)
 
         if (size > 0) {
             ctx->recv.last += size;
-            continue;
+
+            ngx_http_upstream_check_phase_done(peer,
+                                            NGX_HTTP_CHECK_PHASE_FIRST_BYTE);
+
+            /*
+             * Stop reading as soon as the parser has its verdict, the rest
+             * of the response is drained by a kept alive connection.
+             */
+            rc = peer->parse(peer);
+
+            if (rc == NGX_AGAIN) {
+                continue;
+            }
+
+            ngx_http_upstream_check_phase_done(peer,
+                                               NGX_HTTP_CHECK_PHASE_PARSE);
+            break;
+
         } else if (size == 0 || size == NGX_AGAIN) {
             break;
         } else {
@@ -1448,8 +3060,6 @@ ngx_http_upstream_check_recv_handler(ngx_event_t *event)
         }
     }
 
-    rc = peer->parse(peer);
-
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http check parse rc: %i, peer: %V ",
                    rc, &peer->check_peer_addr->name);
@@ -1505,10 +3115,9 @@ ngx_http_upstream_check_http_init(ngx_http_upstream_check_peer_t *peer)
     ctx->send.start = ctx->send.pos = (u_char *)ucscf->send.data;
     ctx->send.end = ctx->send.last = ctx->send.start + ucscf->send.len;
 
-    ctx->recv.start = ctx->recv.pos = NULL;
-    ctx->recv.end = ctx->recv.last = NULL;
-
     ctx->state = 0;
+    ctx->code = 0;
+    ctx->part = 0;
 
     ngx_memzero(&ctx->status, sizeof(ngx_http_status_t));
 
@@ -1577,56 +3186,336 @@ ngx_http_upstream_check_http_parse(ngx_http_upstream_check_peer_t *peer)
 }
 
 
+/*
+ * Reads a whole HTTP/1.1 response, with its Content-Length or chunked
+ * body, so that the next check is sent on a clean connection. A response
+ * that can only end with the connection is judged by its status and the
+ * connection is not reused.
+ */
+
 static ngx_int_t
-ngx_http_upstream_check_fastcgi_process_record(
-    ngx_http_upstream_check_ctx_t *ctx, ngx_buf_t *b, ngx_http_status_t *status)
+ngx_http_upstream_check_http11_parse(ngx_http_upstream_check_peer_t *peer)
 {
-    u_char                     ch, *p;
-    ngx_http_fastcgi_state_e   state;
-
-    state = ctx->state;
+    u_char                              *p, *line;
+    size_t                               n, len;
+    ngx_int_t                            rc, size;
+    ngx_uint_t                           code, code_n;
+    ngx_http_upstream_check_ctx_t       *ctx;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
 
-    for (p = b->pos; p < b->last; p++) {
+    ucscf = peer->conf;
+    ctx = peer->check_data;
 
-        ch = *p;
+    for ( ;; ) {
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http fastcgi record byte: %02Xd", ch);
+        if (ctx->part == ngx_http_check_http11_st_done) {
+            break;
+        }
 
-        switch (state) {
+        if (ctx->part == ngx_http_check_http11_st_status) {
+            rc = ngx_http_upstream_check_parse_status_line(ctx, &ctx->recv,
+                                                           &ctx->status);
+            if (rc == NGX_AGAIN) {
+                return rc;
+            }
 
-        case ngx_http_fastcgi_st_version:
-            if (ch != 1) {
+            if (rc == NGX_ERROR) {
                 ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                              "upstream sent unsupported FastCGI "
-                              "protocol version: %d", ch);
-                return NGX_ERROR;
+                              "http parse status line error with peer: %V ",
+                              &peer->check_peer_addr->name);
+                goto failed;
             }
-            state = ngx_http_fastcgi_st_type;
-            break;
 
-        case ngx_http_fastcgi_st_type:
-            switch (ch) {
-            case NGX_HTTP_FASTCGI_STDOUT:
-            case NGX_HTTP_FASTCGI_STDERR:
-            case NGX_HTTP_FASTCGI_END_REQUEST:
-                status->code = (ngx_uint_t) ch;
-                break;
-            default:
-                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                              "upstream sent invalid FastCGI "
-                              "record type: %d", ch);
-                return NGX_ERROR;
+            ctx->content_length = -1;
+            ctx->chunked = 0;
+            ctx->close = (ctx->status.http_version < NGX_HTTP_VERSION_11);
 
-            }
-            state = ngx_http_fastcgi_st_request_id_hi;
-            break;
+            ctx->part = ngx_http_check_http11_st_headers;
+            continue;
+        }
 
-        /* we support the single request per connection */
+        if (ctx->part == ngx_http_check_http11_st_body
+            || ctx->part == ngx_http_check_http11_st_chunk_data)
+        {
+            n = ngx_min((off_t) (ctx->recv.last - ctx->recv.pos),
+                        ctx->content_length);
 
-        case ngx_http_fastcgi_st_request_id_hi:
-            if (ch != 0) {
-                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+            ctx->recv.pos += n;
+            ctx->content_length -= n;
+
+            if (ctx->content_length) {
+                return NGX_AGAIN;
+            }
+
+            ctx->part = (ctx->part == ngx_http_check_http11_st_body)
+                        ? ngx_http_check_http11_st_done
+                        : ngx_http_check_http11_st_chunk_crlf;
+            continue;
+        }
+
+        /* the other parts are read line by line */
+
+        line = ctx->recv.pos;
+
+        p = ngx_strlchr(line, ctx->recv.last, LF);
+        if (p == NULL) {
+            return NGX_AGAIN;
+        }
+
+        ctx->recv.pos = p + 1;
+
+        len = p - line;
+        if (len && line[len - 1] == CR) {
+            len--;
+        }
+
+        switch (ctx->part) {
+
+        case ngx_http_check_http11_st_headers:
+
+            if (len) {
+                if (ngx_http_upstream_check_http11_header(ctx, line, len)
+                    != NGX_OK)
+                {
+                    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                                  "http11 invalid header \"%*s\" "
+                                  "with peer: %V ",
+                                  len, line, &peer->check_peer_addr->name);
+                    goto failed;
+                }
+
+                break;
+            }
+
+            code = ctx->status.code;
+
+            if (code < 200) {
+
+                /* an interim response, the final one follows */
+
+                ngx_memzero(&ctx->status, sizeof(ngx_http_status_t));
+                ctx->part = ngx_http_check_http11_st_status;
+                break;
+            }
+
+            if (code == 204 || code == 304
+                || (ucscf->send.len > 5
+                    && ngx_strncmp(ucscf->send.data, "HEAD ", 5) == 0))
+            {
+                ctx->part = ngx_http_check_http11_st_done;
+
+            } else if (ctx->chunked) {
+                ctx->part = ngx_http_check_http11_st_chunk_size;
+
+            } else if (ctx->content_length >= 0) {
+                ctx->part = ngx_http_check_http11_st_body;
+
+            } else {
+
+                /* the body ends with the connection */
+
+                ctx->close = 1;
+                ctx->part = ngx_http_check_http11_st_done;
+            }
+
+            break;
+
+        case ngx_http_check_http11_st_chunk_size:
+
+            for (n = 0; n < len && line[n] != ';'; n++) { /* void */ }
+
+            while (n && (line[n - 1] == ' ' || line[n - 1] == '\t')) {
+                n--;
+            }
+
+            size = ngx_hextoi(line, n);
+
+            if (size == NGX_ERROR) {
+                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                              "http11 invalid chunk size with peer: %V ",
+                              &peer->check_peer_addr->name);
+                goto failed;
+            }
+
+            ctx->content_length = size;
+            ctx->part = size ? ngx_http_check_http11_st_chunk_data
+                             : ngx_http_check_http11_st_trailer;
+            break;
+
+        case ngx_http_check_http11_st_chunk_crlf:
+
+            if (len) {
+                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                              "http11 invalid chunk end with peer: %V ",
+                              &peer->check_peer_addr->name);
+                goto failed;
+            }
+
+            ctx->part = ngx_http_check_http11_st_chunk_size;
+            break;
+
+        default: /* ngx_http_check_http11_st_trailer */
+
+            if (len == 0) {
+                ctx->part = ngx_http_check_http11_st_done;
+            }
+
+            break;
+        }
+    }
+
+    if (ctx->close || ctx->recv.pos != ctx->recv.last) {
+        peer->pc.connection->error = 1;
+    }
+
+    code = ctx->status.code;
+
+    if (code >= 200 && code < 300) {
+        code_n = NGX_CHECK_HTTP_2XX;
+    } else if (code >= 300 && code < 400) {
+        code_n = NGX_CHECK_HTTP_3XX;
+    } else if (code >= 400 && code < 500) {
+        code_n = NGX_CHECK_HTTP_4XX;
+    } else if (code >= 500 && code < 600) {
+        code_n = NGX_CHECK_HTTP_5XX;
+    } else {
+        code_n = NGX_CHECK_HTTP_ERR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http11_parse: code_n: %ui, conf: %ui",
+                   code_n, ucscf->code.status_alive);
+
+    if (code_n & ucscf->code.status_alive) {
+        return NGX_OK;
+    } else {
+        return NGX_ERROR;
+    }
+
+failed:
+
+    peer->pc.connection->error = 1;
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_check_http11_header(ngx_http_upstream_check_ctx_t *ctx,
+    u_char *line, size_t len)
+{
+    u_char  *colon, *value, *last;
+
+    colon = ngx_strlchr(line, line + len, ':');
+    if (colon == NULL) {
+        return NGX_ERROR;
+    }
+
+    last = line + len;
+
+    for (value = colon + 1; value < last && *value == ' '; value++) {
+        /* void */
+    }
+
+    while (last > value && (last[-1] == ' ' || last[-1] == '\t')) {
+        last--;
+    }
+
+    len = colon - line;
+
+    if (len == sizeof("Content-Length") - 1
+        && ngx_strncasecmp(line, (u_char *) "Content-Length", len) == 0)
+    {
+        ctx->content_length = ngx_atoof(value, last - value);
+
+        return (ctx->content_length == NGX_ERROR) ? NGX_ERROR : NGX_OK;
+    }
+
+    if (len == sizeof("Transfer-Encoding") - 1
+        && ngx_strncasecmp(line, (u_char *) "Transfer-Encoding", len) == 0)
+    {
+        if (ngx_strlcasestrn(value, last, (u_char *) "chunked",
+                             sizeof("chunked") - 2)
+            == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        ctx->chunked = 1;
+        return NGX_OK;
+    }
+
+    if (len == sizeof("Connection") - 1
+        && ngx_strncasecmp(line, (u_char *) "Connection", len) == 0)
+    {
+        if (ngx_strlcasestrn(value, last, (u_char *) "close",
+                             sizeof("close") - 2)
+            != NULL)
+        {
+            ctx->close = 1;
+
+        } else if (ngx_strlcasestrn(value, last, (u_char *) "keep-alive",
+                                    sizeof("keep-alive") - 2)
+                   != NULL)
+        {
+            ctx->close = 0;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_check_fastcgi_process_record(
+    ngx_http_upstream_check_ctx_t *ctx, ngx_buf_t *b, ngx_http_status_t *status)
+{
+    u_char                     ch, *p;
+    ngx_http_fastcgi_state_e   state;
+
+    state = ctx->state;
+
+    for (p = b->pos; p < b->last; p++) {
+
+        ch = *p;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http fastcgi record byte: %02Xd", ch);
+
+        switch (state) {
+
+        case ngx_http_fastcgi_st_version:
+            if (ch != 1) {
+                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                              "upstream sent unsupported FastCGI "
+                              "protocol version: %d", ch);
+                return NGX_ERROR;
+            }
+            state = ngx_http_fastcgi_st_type;
+            break;
+
+        case ngx_http_fastcgi_st_type:
+            switch (ch) {
+            case NGX_HTTP_FASTCGI_STDOUT:
+            case NGX_HTTP_FASTCGI_STDERR:
+            case NGX_HTTP_FASTCGI_END_REQUEST:
+                status->code = (ngx_uint_t) ch;
+                break;
+            default:
+                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                              "upstream sent invalid FastCGI "
+                              "record type: %d", ch);
+                return NGX_ERROR;
+
+            }
+            state = ngx_http_fastcgi_st_request_id_hi;
+            break;
+
+        /* we support the single request per connection */
+
+        case ngx_http_fastcgi_st_request_id_hi:
+            if (ch != 0) {
+                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
                               "upstream sent unexpected FastCGI "
                               "request id high byte: %d", ch);
                 return NGX_ERROR;
@@ -1683,8 +3572,8 @@ ngx_http_upstream_check_fastcgi_process_record(
 static ngx_int_t
 ngx_http_upstream_check_fastcgi_parse(ngx_http_upstream_check_peer_t *peer)
 {
+    size_t                               n;
     ngx_int_t                            rc;
-    ngx_flag_t                           done;
     ngx_uint_t                           type, code, code_n;
     ngx_http_upstream_check_ctx_t       *ctx;
     ngx_http_upstream_check_srv_conf_t  *ucscf;
@@ -1692,11 +3581,10 @@ ngx_http_upstream_check_fastcgi_parse(ngx_http_upstream_check_peer_t *peer)
     ucscf = peer->conf;
     ctx = peer->check_data;
 
-    if ((ctx->recv.last - ctx->recv.pos) <= 0) {
-        return NGX_AGAIN;
-    }
-
-    done = 0;
+    /*
+     * The records are consumed up to the end of the request, so a kept
+     * alive connection starts the next check on a record boundary.
+     */
 
     for ( ;; ) {
 
@@ -1718,132 +3606,222 @@ ngx_http_upstream_check_fastcgi_parse(ngx_http_upstream_check_peer_t *peer)
                    "check fastcgi parse status line error with peer: %V",
                    &peer->check_peer_addr->name);
 
-                return rc;
+                goto failed;
             }
 
-            if (type != NGX_HTTP_FASTCGI_STDOUT
-                && type != NGX_HTTP_FASTCGI_STDERR)
-            {
-                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                   "check fastcgi sent unexpected FastCGI record: %d", type);
+            if (type == NGX_HTTP_FASTCGI_STDERR) {
+                ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                              "fastcgi check error");
 
-                return NGX_ERROR;
+                goto failed;
             }
 
-            if (type == NGX_HTTP_FASTCGI_STDOUT && ctx->length == 0) {
+            if (type == NGX_HTTP_FASTCGI_STDOUT
+                && ctx->length == 0 && ctx->code == 0)
+            {
                 ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
                    "check fastcgi prematurely closed FastCGI stdout");
 
-                return NGX_ERROR;
+                goto failed;
             }
-        }
-
-        if (ctx->state == ngx_http_fastcgi_st_padding) {
 
-            if (ctx->recv.pos + ctx->padding < ctx->recv.last) {
-                ctx->status.code = ngx_http_fastcgi_st_version;
-                ctx->recv.pos += ctx->padding;
+            if (type == NGX_HTTP_FASTCGI_END_REQUEST
+                && ctx->length != NGX_HTTP_FASTCGI_END_REQUEST_SIZE)
+            {
+                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                   "check fastcgi sent invalid FastCGI end request "
+                   "record length: %uz", ctx->length);
 
-                continue;
+                goto failed;
             }
+        }
 
-            if (ctx->recv.pos + ctx->padding == ctx->recv.last) {
-                ctx->status.code = ngx_http_fastcgi_st_version;
-                ctx->recv.pos = ctx->recv.last;
+        type = ctx->status.code;
 
-                return NGX_AGAIN;
-            }
+        if (ctx->state == ngx_http_fastcgi_st_data) {
 
-            ctx->padding -= ctx->recv.last - ctx->recv.pos;
-            ctx->recv.pos = ctx->recv.last;
+            if (type == NGX_HTTP_FASTCGI_STDOUT && ctx->code == 0) {
+                rc = ngx_http_upstream_check_fastcgi_headers(ctx);
 
-            return NGX_AGAIN;
-        }
+                if (rc == NGX_AGAIN) {
+                    return rc;
+                }
 
-        if (ctx->status.code == NGX_HTTP_FASTCGI_STDERR) {
+                if (rc == NGX_ERROR) {
+                    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                       "fastcgi http parse status line error with peer: %V ",
+                        &peer->check_peer_addr->name);
 
-            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
-                          "fastcgi check error");
+                    goto failed;
+                }
 
-            return NGX_ERROR;
-        }
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                               "fastcgi http parse status: %ui", ctx->code);
+            }
 
-        /* ctx->status.code == NGX_HTTP_FASTCGI_STDOUT */
+            if (type == NGX_HTTP_FASTCGI_END_REQUEST) {
 
-        if (ctx->recv.pos + ctx->length < ctx->recv.last) {
-            ctx->recv.last = ctx->recv.pos + ctx->length;
-        } else {
-            return NGX_ERROR;
-        }
+                if ((size_t) (ctx->recv.last - ctx->recv.pos) < ctx->length) {
+                    return NGX_AGAIN;
+                }
 
-        ctx->status.code = 0;
+                /* appStatus[4], protocolStatus, reserved[3] */
 
-        for ( ;; ) {
-            rc = ngx_http_upstream_check_parse_fastcgi_status(ctx,
-                                                              &ctx->recv,
-                                                              &ctx->status);
-            ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
-                          "fastcgi http parse status line rc: %i ", rc);
+                if (ctx->recv.pos[4] != NGX_HTTP_FASTCGI_REQUEST_COMPLETE) {
+                    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                       "check fastcgi request not completed, "
+                       "protocol status: %d", ctx->recv.pos[4]);
 
-            if (rc == NGX_ERROR) {
-                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                   "fastcgi http parse status line error with peer: %V ",
-                    &peer->check_peer_addr->name);
-                return NGX_ERROR;
+                    goto failed;
+                }
             }
 
-            if (rc == NGX_AGAIN) {
-                break;
-            }
+            n = ngx_min((size_t) (ctx->recv.last - ctx->recv.pos),
+                        ctx->length);
 
-            if (rc == NGX_DONE) {
-                done = 1;
-                ngx_log_error(NGX_LOG_DEBUG, ngx_cycle->log, 0,
-                              "fastcgi http parse status: %i",
-                              ctx->status.code);
-                break;
+            ctx->recv.pos += n;
+            ctx->length -= n;
+
+            if (ctx->length) {
+                return NGX_AGAIN;
             }
 
-            /* rc = NGX_OK */
+            ctx->state = ngx_http_fastcgi_st_padding;
         }
 
-        if (ucscf->code.status_alive == 0 || done == 0) {
-            return NGX_OK;
-        }
+        /* ctx->state == ngx_http_fastcgi_st_padding */
 
-        code = ctx->status.code;
+        n = ngx_min((size_t) (ctx->recv.last - ctx->recv.pos), ctx->padding);
 
-        if (code >= 200 && code < 300) {
-            code_n = NGX_CHECK_HTTP_2XX;
-        } else if (code >= 300 && code < 400) {
-            code_n = NGX_CHECK_HTTP_3XX;
-        } else if (code >= 400 && code < 500) {
-            code_n = NGX_CHECK_HTTP_4XX;
-        } else if (code >= 500 && code < 600) {
-            code_n = NGX_CHECK_HTTP_5XX;
-        } else {
-            code_n = NGX_CHECK_HTTP_ERR;
+        ctx->recv.pos += n;
+        ctx->padding -= n;
+
+        if (ctx->padding) {
+            return NGX_AGAIN;
         }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "fastcgi http_parse: code_n: %ui, conf: %ui",
-                       code_n, ucscf->code.status_alive);
+        ctx->state = ngx_http_fastcgi_st_version;
 
-        if (code_n & ucscf->code.status_alive) {
-            return NGX_OK;
-        } else {
-            return NGX_ERROR;
+        if (type == NGX_HTTP_FASTCGI_END_REQUEST) {
+            break;
         }
+    }
+
+    if (ctx->recv.pos != ctx->recv.last) {
+
+        /* more than the response, the connection is not reused */
 
+        peer->pc.connection->error = 1;
     }
 
-    return NGX_OK;
+    if (ucscf->code.status_alive == 0) {
+        return NGX_OK;
+    }
+
+    code = ctx->code;
+
+    if (code >= 200 && code < 300) {
+        code_n = NGX_CHECK_HTTP_2XX;
+    } else if (code >= 300 && code < 400) {
+        code_n = NGX_CHECK_HTTP_3XX;
+    } else if (code >= 400 && code < 500) {
+        code_n = NGX_CHECK_HTTP_4XX;
+    } else if (code >= 500 && code < 600) {
+        code_n = NGX_CHECK_HTTP_5XX;
+    } else {
+        code_n = NGX_CHECK_HTTP_ERR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "fastcgi http_parse: code_n: %ui, conf: %ui",
+                   code_n, ucscf->code.status_alive);
+
+    if (code_n & ucscf->code.status_alive) {
+        return NGX_OK;
+    } else {
+        return NGX_ERROR;
+    }
+
+failed:
+
+    /* the rest of the response is left unread */
+
+    peer->pc.connection->error = 1;
+
+    return NGX_ERROR;
 }
 
 
+/*
+ * Looks for the "Status" header in the data of the first stdout record,
+ * which is parsed again from its start as more of it arrives. The
+ * response is "200" without it.
+ */
+
 static ngx_int_t
-ngx_http_upstream_check_parse_fastcgi_status(ngx_http_upstream_check_ctx_t *ctx,
-    ngx_buf_t *b, ngx_http_status_t *status)
+ngx_http_upstream_check_fastcgi_headers(ngx_http_upstream_check_ctx_t *ctx)
+{
+    u_char      *start;
+    ngx_buf_t    b;
+    ngx_int_t    rc;
+    ngx_uint_t   state, type;
+    ngx_flag_t   complete;
+
+    complete = (size_t) (ctx->recv.last - ctx->recv.pos) >= ctx->length;
+
+    b.pos = ctx->recv.pos;
+    b.last = complete ? ctx->recv.pos + ctx->length : ctx->recv.last;
+
+    /* the header parser shares the state and the status with the records */
+
+    state = ctx->state;
+    type = ctx->status.code;
+
+    for ( ;; ) {
+        start = b.pos;
+
+        rc = ngx_http_upstream_check_parse_fastcgi_status(ctx, &b,
+                                                          &ctx->status);
+
+        if (rc == NGX_OK) {
+
+            /* the empty line at the end of the headers */
+
+            if (b.pos - start <= 2) {
+                ctx->code = NGX_HTTP_OK;
+                rc = NGX_OK;
+                break;
+            }
+
+            continue;
+        }
+
+        if (rc == NGX_DONE) {
+            ctx->code = ctx->status.code;
+            rc = NGX_OK;
+            break;
+        }
+
+        if (rc == NGX_AGAIN && complete) {
+
+            /* the headers do not fit in the first record */
+
+            rc = NGX_ERROR;
+        }
+
+        break;
+    }
+
+    ctx->state = state;
+    ctx->status.code = type;
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_check_parse_fastcgi_status(ngx_http_upstream_check_ctx_t *ctx,
+    ngx_buf_t *b, ngx_http_status_t *status)
 {
     u_char      c, ch, *p, *name_s, *name_e;
     ngx_flag_t  find;
@@ -2169,6 +4147,7 @@ ngx_http_upstream_check_parse_status_line(ngx_http_upstream_check_ctx_t *ctx,
                 return NGX_ERROR;
             }
 
+            status->http_version = (ch - '0') * 1000;
             state = sw_major_digit;
             break;
 
@@ -2183,6 +4162,12 @@ ngx_http_upstream_check_parse_status_line(ngx_http_upstream_check_ctx_t *ctx,
                 return NGX_ERROR;
             }
 
+            if (status->http_version > 99000) {
+                return NGX_ERROR;
+            }
+
+            status->http_version = status->http_version * 10
+                                   + (ch - '0') * 1000;
             break;
 
         /* the first digit of minor HTTP version */
@@ -2191,6 +4176,7 @@ ngx_http_upstream_check_parse_status_line(ngx_http_upstream_check_ctx_t *ctx,
                 return NGX_ERROR;
             }
 
+            status->http_version += ch - '0';
             state = sw_minor_digit;
             break;
 
@@ -2300,291 +4286,1497 @@ ngx_http_upstream_check_http_reinit(ngx_http_upstream_check_peer_t *peer)
     ctx->recv.pos = ctx->recv.last = ctx->recv.start;
 
     ctx->state = 0;
+    ctx->code = 0;
+    ctx->part = 0;
 
     ngx_memzero(&ctx->status, sizeof(ngx_http_status_t));
 }
 
+/*
+ * A grpc check keeps one http2 connection to the peer and sends each
+ * grpc.health.v1.Health/Check call on a new stream of it. The frames are
+ * built by hand: the header fields are sent as literals or indexed from
+ * the static table, so there is no state of the compression to keep, and
+ * the fields of the responses are not decoded, the status is read from
+ * the HealthCheckResponse message only.
+ */
 
 static ngx_int_t
-ngx_http_upstream_check_ssl_hello_init(ngx_http_upstream_check_peer_t *peer)
+ngx_http_upstream_check_grpc_init(ngx_http_upstream_check_peer_t *peer)
 {
+    size_t                               size;
     ngx_http_upstream_check_ctx_t       *ctx;
     ngx_http_upstream_check_srv_conf_t  *ucscf;
 
     ctx = peer->check_data;
     ucscf = peer->conf;
 
-    ctx->send.start = ctx->send.pos = (u_char *)ucscf->send.data;
-    ctx->send.end = ctx->send.last = ctx->send.start + ucscf->send.len;
+    /* the frames take less than 256 bytes beside the names */
+
+    size = 256 + peer->check_peer_addr->name.len + ucscf->grpc_service.len;
+
+#if (NGX_HTTP_SSL)
+    size += ucscf->ssl_name.len;
+#endif
 
-    ctx->recv.start = ctx->recv.pos = NULL;
-    ctx->recv.end = ctx->recv.last = NULL;
+    ctx->send.start = ngx_pnalloc(ctx->pool, size);
+    if (ctx->send.start == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->send.end = ctx->send.start + size;
+    ctx->reset_pool = 1;
+
+    ctx->state = NGX_HTTP_CHECK_GRPC_ST_FRAME;
+    ctx->code = 0;
+    ctx->stream_id = 1;
+
+    ngx_http_upstream_check_grpc_request(peer, 1);
 
     return NGX_OK;
 }
 
 
-/* a rough check of server ssl_hello responses */
-static ngx_int_t
-ngx_http_upstream_check_ssl_hello_parse(ngx_http_upstream_check_peer_t *peer)
+static void
+ngx_http_upstream_check_grpc_request(ngx_http_upstream_check_peer_t *peer,
+    ngx_uint_t preface)
 {
-    size_t                         size;
-    ngx_ssl_server_hello_t        *resp;
-    ngx_http_upstream_check_ctx_t *ctx;
+    u_char                              *p, *h;
+    size_t                               len;
+    ngx_str_t                           *authority, *service;
+    ngx_uint_t                           scheme;
+    ngx_http_upstream_check_ctx_t       *ctx;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
 
     ctx = peer->check_data;
+    ucscf = peer->conf;
 
-    size = ctx->recv.last - ctx->recv.pos;
-    if (size < sizeof(ngx_ssl_server_hello_t)) {
-        return NGX_AGAIN;
+    authority = &peer->check_peer_addr->name;
+    service = &ucscf->grpc_service;
+
+    /* :scheme: http */
+    scheme = 0x86;
+
+#if (NGX_HTTP_SSL)
+
+    if (ucscf->ssl) {
+
+        /* :scheme: https */
+        scheme = 0x87;
+
+        if (ucscf->ssl_name.len) {
+            authority = &ucscf->ssl_name;
+        }
     }
 
-    resp = (ngx_ssl_server_hello_t *) ctx->recv.pos;
+#endif
 
-    ngx_log_debug7(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http check ssl_parse, type: %ud, version: %ud.%ud, "
-                   "length: %ud, handshanke_type: %ud, hello_version: %ud.%ud",
-                   resp->msg_type, resp->version.major, resp->version.minor,
-                   ntohs(resp->length), resp->handshake_type,
-                   resp->hello_version.major, resp->hello_version.minor);
+    p = ctx->send.start;
 
-    if (resp->msg_type != NGX_SSL_HANDSHAKE) {
-        return NGX_ERROR;
+    if (preface) {
+        p = ngx_cpymem(p, NGX_HTTP_CHECK_H2_PREFACE,
+                       sizeof(NGX_HTTP_CHECK_H2_PREFACE) - 1);
+
+        /* no pushed streams */
+
+        p = ngx_http_upstream_check_h2_frame(p, 6, NGX_HTTP_CHECK_H2_SETTINGS,
+                                             0, 0);
+        *p++ = 0;
+        *p++ = NGX_HTTP_CHECK_H2_ENABLE_PUSH;
+        *p++ = 0;
+        *p++ = 0;
+        *p++ = 0;
+        *p++ = 0;
     }
 
-    if (resp->handshake_type != NGX_SSL_SERVER_HELLO) {
-        return NGX_ERROR;
+    /* the DATA of the previous checks is returned to the connection */
+
+    if (ctx->window) {
+        p = ngx_http_upstream_check_h2_frame(p, 4,
+                                             NGX_HTTP_CHECK_H2_WINDOW_UPDATE,
+                                             0, 0);
+        *p++ = (u_char) (ctx->window >> 24);
+        *p++ = (u_char) (ctx->window >> 16);
+        *p++ = (u_char) (ctx->window >> 8);
+        *p++ = (u_char) ctx->window;
+
+        ctx->window = 0;
     }
 
-    return NGX_OK;
-}
+    h = p;
+    p += NGX_HTTP_CHECK_H2_FRAME_SIZE;
 
+    /* :method: POST */
+    *p++ = 0x83;
+    *p++ = (u_char) scheme;
 
-static void
-ngx_http_upstream_check_ssl_hello_reinit(ngx_http_upstream_check_peer_t *peer)
-{
-    ngx_http_upstream_check_ctx_t *ctx;
+    /* :path, a literal without indexing of an indexed name */
+    *p++ = 0x04;
+    *p++ = sizeof(NGX_HTTP_CHECK_GRPC_PATH) - 1;
+    p = ngx_cpymem(p, NGX_HTTP_CHECK_GRPC_PATH,
+                   sizeof(NGX_HTTP_CHECK_GRPC_PATH) - 1);
 
-    ctx = peer->check_data;
+    /* :authority */
+    *p++ = 0x01;
+    *p++ = (u_char) authority->len;
+    p = ngx_cpymem(p, authority->data, authority->len);
+
+    /* content-type, the index 31 does not fit the prefix of 4 bits */
+    *p++ = 0x0f;
+    *p++ = 31 - 15;
+    *p++ = sizeof(NGX_HTTP_CHECK_GRPC_TYPE) - 1;
+    p = ngx_cpymem(p, NGX_HTTP_CHECK_GRPC_TYPE,
+                   sizeof(NGX_HTTP_CHECK_GRPC_TYPE) - 1);
+
+    /* te: trailers, with a new name */
+    *p++ = 0x00;
+    *p++ = sizeof("te") - 1;
+    p = ngx_cpymem(p, "te", sizeof("te") - 1);
+    *p++ = sizeof("trailers") - 1;
+    p = ngx_cpymem(p, "trailers", sizeof("trailers") - 1);
+
+    (void) ngx_http_upstream_check_h2_frame(h,
+                                    p - h - NGX_HTTP_CHECK_H2_FRAME_SIZE,
+                                    NGX_HTTP_CHECK_H2_HEADERS,
+                                    NGX_HTTP_CHECK_H2_END_HEADERS,
+                                    ctx->stream_id);
+
+    /* the HealthCheckRequest, with the service as its field 1 */
+
+    len = service->len ? 2 + service->len : 0;
+
+    p = ngx_http_upstream_check_h2_frame(p, 5 + len, NGX_HTTP_CHECK_H2_DATA,
+                                         NGX_HTTP_CHECK_H2_END_STREAM,
+                                         ctx->stream_id);
+
+    /* not compressed */
+    *p++ = 0;
+
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = (u_char) len;
+
+    if (service->len) {
+        *p++ = 0x0a;
+        *p++ = (u_char) service->len;
+        p = ngx_cpymem(p, service->data, service->len);
+    }
 
     ctx->send.pos = ctx->send.start;
-    ctx->send.last = ctx->send.end;
+    ctx->send.last = p;
+}
 
-    ctx->recv.pos = ctx->recv.last = ctx->recv.start;
+
+static u_char *
+ngx_http_upstream_check_h2_frame(u_char *p, size_t len, ngx_uint_t type,
+    ngx_uint_t flags, ngx_uint_t stream_id)
+{
+    *p++ = (u_char) (len >> 16);
+    *p++ = (u_char) (len >> 8);
+    *p++ = (u_char) len;
+    *p++ = (u_char) type;
+    *p++ = (u_char) flags;
+    *p++ = (u_char) (stream_id >> 24);
+    *p++ = (u_char) (stream_id >> 16);
+    *p++ = (u_char) (stream_id >> 8);
+    *p++ = (u_char) stream_id;
+
+    return p;
 }
 
 
+/* the acknowledgements are due at once, not with the next check */
+
 static ngx_int_t
-ngx_http_upstream_check_mysql_init(ngx_http_upstream_check_peer_t *peer)
+ngx_http_upstream_check_h2_send(ngx_connection_t *c, ngx_uint_t type,
+    ngx_uint_t flags, u_char *payload, size_t len)
 {
-    ngx_http_upstream_check_ctx_t       *ctx;
-    ngx_http_upstream_check_srv_conf_t  *ucscf;
+    u_char   frame[NGX_HTTP_CHECK_H2_FRAME_SIZE + NGX_HTTP_CHECK_H2_PING_SIZE];
+    u_char  *p;
 
-    ctx = peer->check_data;
-    ucscf = peer->conf;
+    p = ngx_http_upstream_check_h2_frame(frame, len, type, flags, 0);
 
-    ctx->send.start = ctx->send.pos = (u_char *)ucscf->send.data;
-    ctx->send.end = ctx->send.last = ctx->send.start + ucscf->send.len;
+    if (len) {
+        p = ngx_cpymem(p, payload, len);
+    }
 
-    ctx->recv.start = ctx->recv.pos = NULL;
-    ctx->recv.end = ctx->recv.last = NULL;
+    if (c->send(c, frame, p - frame) != p - frame) {
+        return NGX_ERROR;
+    }
 
     return NGX_OK;
 }
 
 
-/* a rough check of mysql greeting responses */
 static ngx_int_t
-ngx_http_upstream_check_mysql_parse(ngx_http_upstream_check_peer_t *peer)
+ngx_http_upstream_check_grpc_parse(ngx_http_upstream_check_peer_t *peer)
 {
-    size_t                         size;
-    ngx_mysql_handshake_init_t    *handshake;
-    ngx_http_upstream_check_ctx_t *ctx;
+    u_char                         *p;
+    size_t                          n, len, size, pad;
+    ngx_uint_t                      type, flags, stream_id, last, done;
+    ngx_connection_t               *c;
+    ngx_http_upstream_check_ctx_t  *ctx;
 
     ctx = peer->check_data;
+    c = peer->pc.connection;
 
-    size = ctx->recv.last - ctx->recv.pos;
-    if (size < sizeof(ngx_mysql_handshake_init_t)) {
-        return NGX_AGAIN;
-    }
+    for ( ;; ) {
+        size = ctx->recv.last - ctx->recv.pos;
 
-    handshake = (ngx_mysql_handshake_init_t *) ctx->recv.pos;
+        if (ctx->state == NGX_HTTP_CHECK_GRPC_ST_SKIP) {
+            n = ngx_min(size, ctx->length);
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "mysql_parse: packet_number=%ud, protocol=%ud, server=%s",
-                   handshake->packet_number, handshake->protocol_version,
-                   handshake->others);
+            ctx->recv.pos += n;
+            ctx->length -= n;
 
-    /* The mysql greeting packet's serial number always begins with 0. */
-    if (handshake->packet_number != 0x00) {
-        return NGX_ERROR;
-    }
+            if (ctx->length) {
+                return NGX_AGAIN;
+            }
 
-    return NGX_OK;
-}
+            ctx->state = NGX_HTTP_CHECK_GRPC_ST_FRAME;
+            continue;
+        }
 
+        if (size < NGX_HTTP_CHECK_H2_FRAME_SIZE) {
+            return NGX_AGAIN;
+        }
 
-static void
-ngx_http_upstream_check_mysql_reinit(ngx_http_upstream_check_peer_t *peer)
-{
-    ngx_http_upstream_check_ctx_t *ctx;
+        p = ctx->recv.pos;
 
-    ctx = peer->check_data;
+        len = (p[0] << 16) | (p[1] << 8) | p[2];
+        type = p[3];
+        flags = p[4];
+        stream_id = ((p[5] & 0x7f) << 24) | (p[6] << 16) | (p[7] << 8) | p[8];
 
-    ctx->send.pos = ctx->send.start;
-    ctx->send.last = ctx->send.end;
+        p += NGX_HTTP_CHECK_H2_FRAME_SIZE;
+        size -= NGX_HTTP_CHECK_H2_FRAME_SIZE;
 
-    ctx->recv.pos = ctx->recv.last = ctx->recv.start;
-}
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "grpc_parse: frame type: %ui, flags: %ui, "
+                       "stream: %ui, length: %uz",
+                       type, flags, stream_id, len);
 
+        done = 0;
 
-static ngx_int_t
-ngx_http_upstream_check_ajp_init(ngx_http_upstream_check_peer_t *peer)
-{
-    ngx_http_upstream_check_ctx_t       *ctx;
-    ngx_http_upstream_check_srv_conf_t  *ucscf;
+        switch (type) {
 
-    ctx = peer->check_data;
-    ucscf = peer->conf;
+        case NGX_HTTP_CHECK_H2_DATA:
+            ctx->window += len;
 
-    ctx->send.start = ctx->send.pos = (u_char *)ucscf->send.data;
-    ctx->send.end = ctx->send.last = ctx->send.start + ucscf->send.len;
+            if (stream_id != ctx->stream_id) {
+                break;
+            }
 
-    ctx->recv.start = ctx->recv.pos = NULL;
-    ctx->recv.end = ctx->recv.last = NULL;
+            /* the pad length and the message of the SERVING status */
 
-    return NGX_OK;
-}
+            if (size < ngx_min(len, sizeof(NGX_HTTP_CHECK_GRPC_SERVING))) {
+                return NGX_AGAIN;
+            }
 
+            n = len;
+            pad = 0;
 
-static ngx_int_t
-ngx_http_upstream_check_ajp_parse(ngx_http_upstream_check_peer_t *peer)
-{
-    size_t                         size;
-    u_char                        *p;
-    ngx_http_upstream_check_ctx_t *ctx;
+            if (flags & NGX_HTTP_CHECK_H2_PADDED) {
+                if (len == 0) {
+                    goto failed;
+                }
 
-    ctx = peer->check_data;
+                pad = *p++;
+                n--;
+            }
 
-    size = ctx->recv.last - ctx->recv.pos;
-    if (size < sizeof(ngx_ajp_cpong_packet)) {
-        return NGX_AGAIN;
-    }
+            if (pad > n) {
+                goto failed;
+            }
 
-    p = ctx->recv.pos;
+            n -= pad;
 
-#if (NGX_DEBUG)
-    {
-    ngx_ajp_raw_packet_t  *ajp;
+            if (n >= sizeof(NGX_HTTP_CHECK_GRPC_SERVING) - 1
+                && ngx_memcmp(p, NGX_HTTP_CHECK_GRPC_SERVING,
+                              sizeof(NGX_HTTP_CHECK_GRPC_SERVING) - 1) == 0)
+            {
+                ctx->code = 1;
+            }
 
-    ajp = (ngx_ajp_raw_packet_t *) p;
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "ajp_parse: preamble=0x%uxd, length=0x%uxd, type=0x%uxd",
-                   ntohs(ajp->preamble), ntohs(ajp->length), ajp->type);
-    }
-#endif
+            done = flags & NGX_HTTP_CHECK_H2_END_STREAM;
+            break;
 
-    if (ngx_memcmp(ngx_ajp_cpong_packet, p, sizeof(ngx_ajp_cpong_packet)) == 0)
-    {
-        return NGX_OK;
-    } else {
-        return NGX_ERROR;
-    }
-}
+        case NGX_HTTP_CHECK_H2_HEADERS:
 
+            /* the trailers, or the headers of a response without a body */
 
-static void
-ngx_http_upstream_check_ajp_reinit(ngx_http_upstream_check_peer_t *peer)
-{
-    ngx_http_upstream_check_ctx_t  *ctx;
+            if (stream_id == ctx->stream_id) {
+                done = flags & NGX_HTTP_CHECK_H2_END_STREAM;
+            }
 
-    ctx = peer->check_data;
+            break;
 
-    ctx->send.pos = ctx->send.start;
-    ctx->send.last = ctx->send.end;
+        case NGX_HTTP_CHECK_H2_RST_STREAM:
 
-    ctx->recv.pos = ctx->recv.last = ctx->recv.start;
-}
+            if (stream_id == ctx->stream_id) {
+                ctx->code = 0;
+                done = 1;
+            }
 
+            break;
 
-static void
-ngx_http_upstream_check_status_update(ngx_http_upstream_check_peer_t *peer,
-    ngx_int_t result)
-{
-    ngx_http_upstream_check_srv_conf_t  *ucscf;
+        case NGX_HTTP_CHECK_H2_SETTINGS:
+
+            if (!(flags & NGX_HTTP_CHECK_H2_ACK)
+                && ngx_http_upstream_check_h2_send(c,
+                                                   NGX_HTTP_CHECK_H2_SETTINGS,
+                                                   NGX_HTTP_CHECK_H2_ACK,
+                                                   NULL, 0)
+                   != NGX_OK)
+            {
+                goto failed;
+            }
+
+            break;
+
+        case NGX_HTTP_CHECK_H2_PING:
+
+            if (len != NGX_HTTP_CHECK_H2_PING_SIZE) {
+                goto failed;
+            }
+
+            if (size < NGX_HTTP_CHECK_H2_PING_SIZE) {
+                return NGX_AGAIN;
+            }
+
+            if (!(flags & NGX_HTTP_CHECK_H2_ACK)
+                && ngx_http_upstream_check_h2_send(c, NGX_HTTP_CHECK_H2_PING,
+                                                   NGX_HTTP_CHECK_H2_ACK,
+                                                   p, len)
+                   != NGX_OK)
+            {
+                goto failed;
+            }
+
+            break;
+
+        case NGX_HTTP_CHECK_H2_GOAWAY:
+
+            if (len < 8) {
+                goto failed;
+            }
+
+            if (size < 4) {
+                return NGX_AGAIN;
+            }
+
+            last = ((p[0] & 0x7f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+
+            /* the stream is not processed when it is past the last one */
+
+            ctx->close = 1;
+
+            if (last < ctx->stream_id) {
+                ctx->code = 0;
+                done = 1;
+            }
+
+            break;
+
+        default:
+            break;
+        }
+
+        ctx->recv.pos += NGX_HTTP_CHECK_H2_FRAME_SIZE;
+        ctx->length = len;
+        ctx->state = NGX_HTTP_CHECK_GRPC_ST_SKIP;
+
+        if (!done) {
+            continue;
+        }
+
+        /* the rest of the frame is skipped by the next check */
+
+        if (ctx->close || ctx->stream_id >= NGX_HTTP_CHECK_H2_MAX_STREAM) {
+            c->error = 1;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "grpc_parse: stream: %ui, serving: %ui",
+                       ctx->stream_id, ctx->code);
+
+        return ctx->code ? NGX_OK : NGX_ERROR;
+    }
+
+failed:
+
+    c->error = 1;
+
+    return NGX_ERROR;
+}
+
+
+/*
+ * The frames coming between two checks, the acknowledgements of our
+ * settings or the pings of the server, are read in the buffer of the
+ * context, so that the next check parses them in order.
+ */
+
+static ngx_int_t
+ngx_http_upstream_check_grpc_read(ngx_http_upstream_check_peer_t *peer)
+{
+    size_t                          n;
+    ssize_t                         size;
+    ngx_connection_t               *c;
+    ngx_http_upstream_check_ctx_t  *ctx;
+
+    ctx = peer->check_data;
+    c = peer->pc.connection;
+
+    if (ctx == NULL || ctx->recv.start == NULL) {
+        return NGX_ERROR;
+    }
+
+    for ( ;; ) {
+
+        if (ctx->recv.last == ctx->recv.end) {
+            if (ctx->recv.pos == ctx->recv.start) {
+                return NGX_ERROR;
+            }
+
+            n = ctx->recv.last - ctx->recv.pos;
+            ngx_memmove(ctx->recv.start, ctx->recv.pos, n);
+
+            ctx->recv.pos = ctx->recv.start;
+            ctx->recv.last = ctx->recv.start + n;
+        }
+
+        size = c->recv(c, ctx->recv.last, ctx->recv.end - ctx->recv.last);
+
+        if (size > 0) {
+            ctx->recv.last += size;
+            continue;
+        }
+
+        if (size == NGX_AGAIN) {
+            return NGX_OK;
+        }
+
+        if (size == 0) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "peer closed its half side of the connection");
+        }
+
+        return NGX_ERROR;
+    }
+}
+
+
+static void
+ngx_http_upstream_check_grpc_reinit(ngx_http_upstream_check_peer_t *peer)
+{
+    ngx_http_upstream_check_ctx_t  *ctx;
+
+    ctx = peer->check_data;
+
+    /* the frames not parsed yet belong to the next check */
+
+    if (ctx->recv.pos == ctx->recv.last) {
+        ctx->recv.pos = ctx->recv.last = ctx->recv.start;
+    }
+
+    ctx->code = 0;
+    ctx->stream_id += 2;
+
+    ngx_http_upstream_check_grpc_request(peer, 0);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_check_redis_init(ngx_http_upstream_check_peer_t *peer)
+{
+    ngx_http_upstream_check_ctx_t       *ctx;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    ctx = peer->check_data;
+    ucscf = peer->conf;
+
+    ctx->send.start = ctx->send.pos = (u_char *)ucscf->send.data;
+    ctx->send.end = ctx->send.last = ctx->send.start + ucscf->send.len;
+
+    ctx->state = NGX_HTTP_CHECK_REDIS_ST_LINE;
+    ctx->part = NGX_HTTP_CHECK_REDIS_PING;
+    ctx->elements = 1;
+    ctx->element = 0;
+    ctx->role = 0;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Reads the replies to PING and to ROLE as they arrive. The elements of
+ * a reply are counted, the ones of the nested arrays too, until the whole
+ * reply is read, so the connection is left clean for the next check.
+ */
+
+static ngx_int_t
+ngx_http_upstream_check_redis_parse(ngx_http_upstream_check_peer_t *peer)
+{
+    u_char                              *p, *lf, *bulk;
+    size_t                               len;
+    ngx_int_t                            n;
+    ngx_uint_t                           index;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_check_ctx_t       *ctx;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    ctx = peer->check_data;
+    ucscf = peer->conf;
+    c = peer->pc.connection;
+
+    for ( ;; ) {
+
+        if (ctx->state == NGX_HTTP_CHECK_REDIS_ST_BULK) {
+            len = ngx_min((size_t) (ctx->recv.last - ctx->recv.pos),
+                          ctx->length);
+
+            ctx->recv.pos += len;
+            ctx->length -= len;
+
+            if (ctx->length) {
+                return NGX_AGAIN;
+            }
+
+            ctx->state = NGX_HTTP_CHECK_REDIS_ST_LINE;
+        }
+
+        if (ctx->elements == 0) {
+
+            if (ctx->part == NGX_HTTP_CHECK_REDIS_PING && ucscf->redis_role) {
+                ctx->part = NGX_HTTP_CHECK_REDIS_ROLE;
+                ctx->elements = 1;
+                ctx->element = 0;
+                continue;
+            }
+
+            break;
+        }
+
+        p = ctx->recv.pos;
+
+        lf = ngx_strlchr(p, ctx->recv.last, LF);
+        if (lf == NULL) {
+            return NGX_AGAIN;
+        }
+
+        if (lf - p < 2 || *(lf - 1) != CR) {
+            goto failed;
+        }
+
+        /* the line without its type and CRLF */
+        len = lf - p - 2;
+
+        bulk = lf + 1;
+        index = ctx->element;
+        n = 0;
+
+        if (*p == '*' || *p == '$') {
+
+            if (len == 2 && p[1] == '-' && p[2] == '1') {
+                /* a null array or bulk string */
+                n = -1;
+
+            } else {
+                n = ngx_atoi(p + 1, len);
+                if (n == NGX_ERROR) {
+                    goto failed;
+                }
+            }
+        }
+
+        switch (*p) {
+
+        case '+':
+
+            if (ctx->part == NGX_HTTP_CHECK_REDIS_PING
+                && (len != 4 || ngx_strncmp(p + 1, "PONG", 4) != 0))
+            {
+                goto failed;
+            }
+
+            break;
+
+        case '-':
+
+            /* e.g. LOADING while the dataset is loaded */
+
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "check redis error \"%*s\" with peer: %V ",
+                          len, p + 1, &peer->check_peer_addr->name);
+
+            goto failed;
+
+        case ':':
+            break;
+
+        case '*':
+
+            if (n > 0) {
+                ctx->elements += n;
+            }
+
+            break;
+
+        case '$':
+
+            if (n < 0) {
+                break;
+            }
+
+            if (ctx->part == NGX_HTTP_CHECK_REDIS_ROLE
+                && (index == NGX_HTTP_CHECK_REDIS_ROLE_NAME
+                    || index == NGX_HTTP_CHECK_REDIS_ROLE_STATE))
+            {
+                if (ctx->recv.last - bulk < n + 2) {
+                    return NGX_AGAIN;
+                }
+
+                if (index == NGX_HTTP_CHECK_REDIS_ROLE_NAME) {
+
+                    if (n == 6 && ngx_strncmp(bulk, "master", 6) == 0) {
+                        ctx->role = NGX_HTTP_CHECK_REDIS_MASTER;
+
+                    } else if (n == 5 && ngx_strncmp(bulk, "slave", 5) == 0) {
+                        ctx->role = NGX_HTTP_CHECK_REDIS_SLAVE;
+                    }
+
+                } else if (ctx->role == NGX_HTTP_CHECK_REDIS_SLAVE
+                           && n == 9 && ngx_strncmp(bulk, "connected", 9) == 0)
+                {
+                    ctx->role = NGX_HTTP_CHECK_REDIS_REPLICA;
+                }
+            }
+
+            ctx->state = NGX_HTTP_CHECK_REDIS_ST_BULK;
+            ctx->length = n + 2;
+            break;
+
+        default:
+            goto failed;
+        }
+
+        ctx->recv.pos = bulk;
+        ctx->elements--;
+        ctx->element++;
+    }
+
+    if (ctx->recv.pos != ctx->recv.last) {
+        c->error = 1;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "redis_parse: role: %ui, conf: %ui",
+                   ctx->role, ucscf->redis_role);
+
+    if (ucscf->redis_role && !(ctx->role & ucscf->redis_role)) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+
+failed:
+
+    c->error = 1;
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_upstream_check_redis_reinit(ngx_http_upstream_check_peer_t *peer)
+{
+    ngx_http_upstream_check_ctx_t  *ctx;
+
+    ctx = peer->check_data;
+
+    ctx->send.pos = ctx->send.start;
+    ctx->send.last = ctx->send.end;
+
+    ctx->recv.pos = ctx->recv.last = ctx->recv.start;
+
+    ctx->state = NGX_HTTP_CHECK_REDIS_ST_LINE;
+    ctx->part = NGX_HTTP_CHECK_REDIS_PING;
+    ctx->elements = 1;
+    ctx->element = 0;
+    ctx->role = 0;
+}
+
+
+/* a single "VERSION ..." line, any other reply fails the check */
+
+static ngx_int_t
+ngx_http_upstream_check_memcached_parse(ngx_http_upstream_check_peer_t *peer)
+{
+    u_char                         *p, *lf;
+    ngx_connection_t               *c;
+    ngx_http_upstream_check_ctx_t  *ctx;
+
+    ctx = peer->check_data;
+    c = peer->pc.connection;
+
+    p = ctx->recv.pos;
+
+    lf = ngx_strlchr(p, ctx->recv.last, LF);
+    if (lf == NULL) {
+        return NGX_AGAIN;
+    }
+
+    ctx->recv.pos = lf + 1;
+
+    if (lf - p < (ssize_t) sizeof("VERSION \r") - 1
+        || *(lf - 1) != CR
+        || ngx_strncmp(p, "VERSION ", sizeof("VERSION ") - 1) != 0)
+    {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "check memcached reply \"%*s\" with peer: %V ",
+                      (size_t) (lf - p), p, &peer->check_peer_addr->name);
+
+        c->error = 1;
+        return NGX_ERROR;
+    }
+
+    if (ctx->recv.pos != ctx->recv.last) {
+        c->error = 1;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_check_ssl_hello_init(ngx_http_upstream_check_peer_t *peer)
+{
+    ngx_http_upstream_check_ctx_t       *ctx;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    ctx = peer->check_data;
+    ucscf = peer->conf;
+
+    ctx->send.start = ctx->send.pos = (u_char *)ucscf->send.data;
+    ctx->send.end = ctx->send.last = ctx->send.start + ucscf->send.len;
+
+    return NGX_OK;
+}
+
+
+/* a rough check of server ssl_hello responses */
+static ngx_int_t
+ngx_http_upstream_check_ssl_hello_parse(ngx_http_upstream_check_peer_t *peer)
+{
+    size_t                         size;
+    ngx_ssl_server_hello_t        *resp;
+    ngx_http_upstream_check_ctx_t *ctx;
+
+    ctx = peer->check_data;
+
+    size = ctx->recv.last - ctx->recv.pos;
+    if (size < sizeof(ngx_ssl_server_hello_t)) {
+        return NGX_AGAIN;
+    }
+
+    resp = (ngx_ssl_server_hello_t *) ctx->recv.pos;
+
+    ngx_log_debug7(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http check ssl_parse, type: %ud, version: %ud.%ud, "
+                   "length: %ud, handshanke_type: %ud, hello_version: %ud.%ud",
+                   resp->msg_type, resp->version.major, resp->version.minor,
+                   ntohs(resp->length), resp->handshake_type,
+                   resp->hello_version.major, resp->hello_version.minor);
+
+    if (resp->msg_type != NGX_SSL_HANDSHAKE) {
+        return NGX_ERROR;
+    }
+
+    if (resp->handshake_type != NGX_SSL_SERVER_HELLO) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_check_ssl_hello_reinit(ngx_http_upstream_check_peer_t *peer)
+{
+    ngx_http_upstream_check_ctx_t *ctx;
+
+    ctx = peer->check_data;
+
+    ctx->send.pos = ctx->send.start;
+    ctx->send.last = ctx->send.end;
+
+    ctx->recv.pos = ctx->recv.last = ctx->recv.start;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_check_mysql_init(ngx_http_upstream_check_peer_t *peer)
+{
+    ngx_http_upstream_check_ctx_t       *ctx;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    ctx = peer->check_data;
+    ucscf = peer->conf;
+
+    ctx->send.start = ctx->send.pos = (u_char *)ucscf->send.data;
+    ctx->send.end = ctx->send.last = ctx->send.start + ucscf->send.len;
+
+    return NGX_OK;
+}
+
+
+/* a rough check of mysql greeting responses */
+static ngx_int_t
+ngx_http_upstream_check_mysql_parse(ngx_http_upstream_check_peer_t *peer)
+{
+    size_t                         size;
+    ngx_mysql_handshake_init_t    *handshake;
+    ngx_http_upstream_check_ctx_t *ctx;
+
+    ctx = peer->check_data;
+
+    size = ctx->recv.last - ctx->recv.pos;
+    if (size < sizeof(ngx_mysql_handshake_init_t)) {
+        return NGX_AGAIN;
+    }
+
+    handshake = (ngx_mysql_handshake_init_t *) ctx->recv.pos;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "mysql_parse: packet_number=%ud, protocol=%ud, server=%s",
+                   handshake->packet_number, handshake->protocol_version,
+                   handshake->others);
+
+    /* The mysql greeting packet's serial number always begins with 0. */
+    if (handshake->packet_number != 0x00) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_check_mysql_reinit(ngx_http_upstream_check_peer_t *peer)
+{
+    ngx_http_upstream_check_ctx_t *ctx;
+
+    ctx = peer->check_data;
+
+    ctx->send.pos = ctx->send.start;
+    ctx->send.last = ctx->send.end;
+
+    ctx->recv.pos = ctx->recv.last = ctx->recv.start;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_check_ajp_init(ngx_http_upstream_check_peer_t *peer)
+{
+    ngx_http_upstream_check_ctx_t       *ctx;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    ctx = peer->check_data;
+    ucscf = peer->conf;
+
+    ctx->send.start = ctx->send.pos = (u_char *)ucscf->send.data;
+    ctx->send.end = ctx->send.last = ctx->send.start + ucscf->send.len;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_check_ajp_parse(ngx_http_upstream_check_peer_t *peer)
+{
+    size_t                         size;
+    u_char                        *p;
+    ngx_http_upstream_check_ctx_t *ctx;
+
+    ctx = peer->check_data;
+
+    size = ctx->recv.last - ctx->recv.pos;
+    if (size < sizeof(ngx_ajp_cpong_packet)) {
+        return NGX_AGAIN;
+    }
+
+    p = ctx->recv.pos;
+
+#if (NGX_DEBUG)
+    {
+    ngx_ajp_raw_packet_t  *ajp;
+
+    ajp = (ngx_ajp_raw_packet_t *) p;
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "ajp_parse: preamble=0x%uxd, length=0x%uxd, type=0x%uxd",
+                   ntohs(ajp->preamble), ntohs(ajp->length), ajp->type);
+    }
+#endif
+
+    if (ngx_memcmp(ngx_ajp_cpong_packet, p, sizeof(ngx_ajp_cpong_packet)) == 0)
+    {
+        return NGX_OK;
+    } else {
+        return NGX_ERROR;
+    }
+}
+
+
+static void
+ngx_http_upstream_check_ajp_reinit(ngx_http_upstream_check_peer_t *peer)
+{
+    ngx_http_upstream_check_ctx_t  *ctx;
+
+    ctx = peer->check_data;
+
+    ctx->send.pos = ctx->send.start;
+    ctx->send.last = ctx->send.end;
+
+    ctx->recv.pos = ctx->recv.last = ctx->recv.start;
+}
+
+
+static void
+ngx_http_upstream_check_phase_done(ngx_http_upstream_check_peer_t *peer,
+    ngx_uint_t phase)
+{
+    ngx_msec_t                           elapsed;
+    ngx_atomic_uint_t                    avg;
+    ngx_http_upstream_check_peer_shm_t  *shm;
+
+    /* a phase is timed once per check, the phases may be skipped */
+
+    if (peer->phase > phase) {
+        return;
+    }
+
+    shm = peer->shm;
+    elapsed = ngx_current_msec - peer->phase_start;
+
+    /* the average starts at the first sample and then moves by 1/8 */
+
+    avg = shm->phase_avg[phase];
+
+    if (avg) {
+        avg--;
+        avg = avg - (avg >> 3) + elapsed;
+
+    } else {
+        avg = elapsed << 3;
+    }
+
+    shm->phase_last[phase] = elapsed;
+    shm->phase_avg[phase] = avg + 1;
+
+    peer->phase = phase + 1;
+    peer->phase_start = ngx_current_msec;
+
+    /*
+     * The round trip is the wait for the first byte of the response, or
+     * the connect for the checks not sending anything.
+     */
+
+    if (phase == NGX_HTTP_CHECK_PHASE_FIRST_BYTE
+        || (phase == NGX_HTTP_CHECK_PHASE_CONNECT
+            && peer->conf->check_type_conf->type == NGX_HTTP_CHECK_TCP))
+    {
+        ngx_http_upstream_check_rtt_update(peer, elapsed);
+    }
+}
+
+
+static void
+ngx_http_upstream_check_rtt_update(ngx_http_upstream_check_peer_t *peer,
+    ngx_msec_t rtt)
+{
+    ngx_atomic_uint_t  srtt;
+
+    srtt = peer->shm->srtt;
+
+    if (srtt) {
+        srtt--;
+        srtt = srtt - (srtt >> 3) + rtt;
+
+    } else {
+        srtt = rtt << 3;
+    }
+
+    peer->shm->srtt = srtt + 1;
+}
+
+
+static void
+ngx_http_upstream_check_status_update(ngx_http_upstream_check_peer_t *peer,
+    ngx_int_t result)
+{
+    ngx_uint_t                           i, changed;
+    ngx_msec_t                           duration;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    ucscf = peer->conf;
+
+    duration = ngx_current_msec - peer->check_start;
+
+    for (i = 0; duration > ngx_http_upstream_check_duration_buckets[i].msec;
+         i++)
+    {
+        /* void */
+    }
+
+    (void) ngx_atomic_fetch_add(&peer->shm->checks, 1);
+    (void) ngx_atomic_fetch_add(&peer->shm->duration[i], 1);
+    (void) ngx_atomic_fetch_add(&peer->shm->duration_sum, duration);
+
+    if (!result) {
+        (void) ngx_atomic_fetch_add(&peer->shm->failures, 1);
+    }
+
+    changed = 0;
+
+    /* check_passive may mark the peer down while it is checked */
+
+    ngx_shmtx_lock(&peer->shm->mutex);
+
+    if (peer->shm->passive_down) {
+        peer->shm->passive_down = 0;
+        peer->shm->rise_count = 0;
+
+        if (ucscf->check_interval_min != ucscf->check_interval_max) {
+            peer->shm->interval = ucscf->check_interval_min;
+        }
+    }
+
+    if (result) {
+        if(peer->shm->rise_count < (ngx_uint_t)-1) {
+            peer->shm->rise_count++;
+        }else{
+            peer->shm->rise_count = ucscf->rise_count;
+        }
+        peer->shm->fall_count = 0;
+        if (peer->shm->down && peer->shm->rise_count >= ucscf->rise_count) {
+            peer->shm->down = 0;
+            changed = 1;
+
+            if (ucscf->slow_start) {
+                peer->shm->recovered = ngx_current_msec;
+            }
+
+            ngx_http_upstream_check_map_set_peer(peer, 0);
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                          "enable check peer: %V ",
+                          &peer->check_peer_addr->name);
+        }
+    } else {
+        peer->shm->rise_count = 0;
+        if(peer->shm->fall_count < (ngx_uint_t)-1) {
+            peer->shm->fall_count++;
+        }else{
+            peer->shm->fall_count = ucscf->fall_count;
+        }        
+        if (!peer->shm->down && peer->shm->fall_count >= ucscf->fall_count) {
+            peer->shm->down = 1;
+            changed = 1;
+            ngx_http_upstream_check_map_set_peer(peer, 1);
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                          "disable check peer: %V ",
+                          &peer->check_peer_addr->name);
+        }
+    }
+
+    ngx_shmtx_unlock(&peer->shm->mutex);
+
+    peer->shm->access_time = ngx_current_msec;
+
+    if (peer->shm->fast_start) {
+
+        /* it ends with the first verdict, up or failed */
+
+        if (peer->shm->down && result) {
+            return;
+        }
+
+        ngx_http_upstream_check_fast_start_done(peer);
+        return;
+    }
+
+    if (ucscf->check_interval_min != ucscf->check_interval_max) {
+        ngx_http_upstream_check_adapt_interval(peer, result, changed);
+    }
+}
+
+
+static ngx_msec_t
+ngx_http_upstream_check_peer_interval(ngx_http_upstream_check_peer_t *peer)
+{
+    ngx_msec_t                           interval;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    ucscf = peer->conf;
+
+    if (peer->shm->fast_start) {
+        return ngx_min(ucscf->check_interval_min,
+                       NGX_HTTP_CHECK_FAST_START_INTERVAL);
+    }
+
+    interval = peer->shm->interval;
+
+    if (interval == 0) {
+        return ucscf->check_interval;
+    }
+
+    /* the bounds may have changed on reload */
+
+    if (interval < ucscf->check_interval_min) {
+        return ucscf->check_interval_min;
+    }
+
+    if (interval > ucscf->check_interval_max) {
+        return ucscf->check_interval_max;
+    }
+
+    return interval;
+}
+
+
+static void
+ngx_http_upstream_check_adapt_interval(ngx_http_upstream_check_peer_t *peer,
+    ngx_int_t result, ngx_uint_t changed)
+{
+    ngx_msec_t                           interval;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    ucscf = peer->conf;
+    interval = ngx_http_upstream_check_peer_interval(peer);
+
+    if (result && !changed && !peer->shm->down) {
+
+        /* a stable up peer is checked less and less often */
+
+        interval += interval / 2;
+
+        peer->shm->interval = ngx_min(interval, ucscf->check_interval_max);
+        return;
+    }
+
+    /*
+     * Look closely at a failing, flapping or recovering peer, the next
+     * check is moved in as it was scheduled with the longer interval.
+     */
+
+    peer->shm->interval = ucscf->check_interval_min;
+
+    if (interval > ucscf->check_interval_min) {
+        ngx_http_upstream_check_wheel_add(peer, ucscf->check_interval_min);
+    }
+}
+
+
+static void
+ngx_http_upstream_check_fast_start_done(ngx_http_upstream_check_peer_t *peer)
+{
+    ngx_msec_t                           ready;
+    ngx_http_upstream_check_peers_shm_t *peers_shm;
+
+    if (!ngx_atomic_cmp_set(&peer->shm->fast_start, 1, 0)) {
+        return;
+    }
+
+    /* back to the normal pace */
+
+    ngx_http_upstream_check_wheel_add(peer,
+                                      ngx_http_upstream_check_peer_interval(peer));
+
+    peers_shm = check_peers_ctx->peers_shm;
+
+    if (ngx_atomic_fetch_add(&peers_shm->converging, -1) != 1) {
+        return;
+    }
+
+    ready = ngx_current_msec - peers_shm->converge_start;
+    peers_shm->ready_time = ready ? ready : 1;
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http upstream check, fast start converged in %Mms",
+                  ready);
+}
+
+
+static void
+ngx_http_upstream_check_map_set(ngx_http_upstream_check_peers_shm_t *peers_shm,
+    ngx_uint_t index, ngx_uint_t down)
+{
+    ngx_atomic_t       *word;
+    ngx_atomic_uint_t   old, new, bit;
+
+    word = &peers_shm->down_map[index / NGX_HTTP_CHECK_MAP_WORD_BITS];
+    bit = (ngx_atomic_uint_t) 1 << (index % NGX_HTTP_CHECK_MAP_WORD_BITS);
+
+    do {
+        old = *word;
+        new = down ? (old | bit) : (old & ~bit);
+
+        if (new == old) {
+            return;
+        }
+
+    } while (!ngx_atomic_cmp_set(word, old, new));
+
+    (void) ngx_atomic_fetch_add(&peers_shm->map_generation, 1);
+}
+
+
+static void
+ngx_http_upstream_check_map_set_peer(ngx_http_upstream_check_peer_t *peer,
+    ngx_uint_t down)
+{
+    if (peer->primary) {
+        peer = peer->primary;
+    }
+
+    for ( /* void */ ; peer; peer = peer->alias_next) {
+        ngx_http_upstream_check_map_set(check_peers_ctx->peers_shm,
+                                        peer->index, down);
+    }
+}
+
+
+static void
+ngx_http_upstream_check_clean_event(ngx_http_upstream_check_peer_t *peer)
+{
+    ngx_connection_t                    *c;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+    ngx_check_conf_t                    *cf;
+
+    c = peer->pc.connection;
+    ucscf = peer->conf;
+    cf = ucscf->check_type_conf;
+
+    if (c) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http check clean event: index:%i, fd: %d",
+                       peer->index, c->fd);
+        if (c->error == 0 &&
+            cf->need_keepalive &&
+            (c->requests < ucscf->check_keepalive_requests))
+        {
+            c->write->handler = ngx_http_upstream_check_dummy_handler;
+            c->read->handler = ngx_http_upstream_check_discard_handler;
+        } else {
+            ngx_http_upstream_check_close_connection(peer);
+        }
+    }
+
+    if (peer->check_timeout_ev.timer_set) {
+        ngx_del_timer(&peer->check_timeout_ev);
+    }
+
+    peer->state = NGX_HTTP_CHECK_ALL_DONE;
+
+    if (peer->pc.connection == NULL) {
+        ngx_http_upstream_check_ctx_free(peer);
+
+    } else if (peer->check_data != NULL && peer->reinit) {
+        peer->reinit(peer);
+    }
+
+    peer->shm->owner = NGX_INVALID_PID;
+
+    if (peer->inflight) {
+        ngx_http_upstream_check_inflight_release(peer);
+    }
+}
+
+
+/*
+ * check_max_inflight bounds the checks a worker runs at once, in total and
+ * per upstream. A peer finding no room waits in a FIFO, still owning its
+ * check, and is started as soon as a check of the worker completes. The
+ * begin handler refreshes its access time meanwhile, so no other worker
+ * takes a waiting peer over and checks it a second time.
+ */
+
+static ngx_int_t
+ngx_http_upstream_check_inflight_acquire(ngx_http_upstream_check_peer_t *peer)
+{
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    ucscf = peer->conf;
+
+    if (peer->inflight) {
+        return NGX_OK;
+    }
+
+    if ((ngx_http_upstream_check_max_inflight_n
+         && ngx_http_upstream_check_inflight
+            >= ngx_http_upstream_check_max_inflight_n)
+        || (ucscf->check_max_inflight
+            && ucscf->inflight >= ucscf->check_max_inflight))
+    {
+        if (!peer->pending) {
+            ngx_queue_insert_tail(&ngx_http_upstream_check_pending,
+                                  &peer->pending_queue);
+            peer->pending = 1;
+        }
+
+        return NGX_BUSY;
+    }
+
+    if (peer->pending) {
+        ngx_queue_remove(&peer->pending_queue);
+        peer->pending = 0;
+    }
+
+    peer->inflight = 1;
+    ucscf->inflight++;
+    ngx_http_upstream_check_inflight++;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_check_inflight_release(ngx_http_upstream_check_peer_t *peer)
+{
+    ngx_queue_t                         *q;
+    ngx_http_upstream_check_peer_t      *next;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    static ngx_uint_t                    draining;
+
+    peer->inflight = 0;
+    peer->conf->inflight--;
+    ngx_http_upstream_check_inflight--;
+
+    /* a check failing at once releases its slot from within the loop */
+
+    if (draining) {
+        return;
+    }
+
+    draining = 1;
+
+    q = ngx_queue_head(&ngx_http_upstream_check_pending);
+
+    while (q != ngx_queue_sentinel(&ngx_http_upstream_check_pending)) {
+
+        if (ngx_http_upstream_check_max_inflight_n
+            && ngx_http_upstream_check_inflight
+               >= ngx_http_upstream_check_max_inflight_n)
+        {
+            break;
+        }
+
+        next = ngx_queue_data(q, ngx_http_upstream_check_peer_t,
+                              pending_queue);
+        q = ngx_queue_next(q);
+
+        ucscf = next->conf;
+
+        /* skip over the peers of the upstreams still at their limit */
+
+        if (ucscf->check_max_inflight
+            && ucscf->inflight >= ucscf->check_max_inflight)
+        {
+            continue;
+        }
+
+        ngx_http_upstream_check_connect_handler(&next->check_ev);
+    }
+
+    draining = 0;
+}
+
+
+/*
+ * The check contexts and their pools are shared by the peers of a worker,
+ * a peer borrows one for a check and returns it once its connection is
+ * closed, so the number of them follows the checks in flight.
+ */
+
+static ngx_int_t
+ngx_http_upstream_check_ctx_get(ngx_http_upstream_check_peer_t *peer)
+{
+    u_char                         *start, *end;
+    ngx_pool_t                     *pool;
+    ngx_queue_t                    *q;
+    ngx_http_upstream_check_ctx_t  *ctx;
+
+    if (!ngx_queue_empty(&ngx_http_upstream_check_ctx_queue)) {
+
+        q = ngx_queue_head(&ngx_http_upstream_check_ctx_queue);
+        ngx_queue_remove(q);
+
+        ctx = ngx_queue_data(q, ngx_http_upstream_check_ctx_t, queue);
 
-    ucscf = peer->conf;
+        pool = ctx->pool;
+        start = ctx->recv.start;
+        end = ctx->recv.end;
+
+        ngx_memzero(ctx, sizeof(ngx_http_upstream_check_ctx_t));
+
+        ctx->pool = pool;
+        ctx->recv.start = ctx->recv.pos = ctx->recv.last = start;
+        ctx->recv.end = end;
 
-    if (result) {
-        if(peer->shm->rise_count < (ngx_uint_t)-1) {
-            peer->shm->rise_count++;
-        }else{
-            peer->shm->rise_count = ucscf->rise_count;
-        }
-        peer->shm->fall_count = 0;
-        if (peer->shm->down && peer->shm->rise_count >= ucscf->rise_count) {
-            peer->shm->down = 0;
-            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                          "enable check peer: %V ",
-                          &peer->check_peer_addr->name);
-        }
     } else {
-        peer->shm->rise_count = 0;
-        if(peer->shm->fall_count < (ngx_uint_t)-1) {
-            peer->shm->fall_count++;
-        }else{
-            peer->shm->fall_count = ucscf->fall_count;
-        }        
-        if (!peer->shm->down && peer->shm->fall_count >= ucscf->fall_count) {
-            peer->shm->down = 1;
-            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                          "disable check peer: %V ",
-                          &peer->check_peer_addr->name);
+
+        ctx = ngx_pcalloc(ngx_cycle->pool,
+                          sizeof(ngx_http_upstream_check_ctx_t));
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->pool = ngx_create_pool(ngx_pagesize, ngx_cycle->log);
+        if (ctx->pool == NULL) {
+            return NGX_ERROR;
         }
     }
 
-    peer->shm->access_time = ngx_current_msec;
+    peer->check_data = ctx;
+
+    if (peer->init == NULL || peer->init(peer) != NGX_OK) {
+        ngx_http_upstream_check_ctx_free(peer);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
 }
 
 
 static void
-ngx_http_upstream_check_clean_event(ngx_http_upstream_check_peer_t *peer)
+ngx_http_upstream_check_ctx_free(ngx_http_upstream_check_peer_t *peer)
 {
-    ngx_connection_t                    *c;
-    ngx_http_upstream_check_srv_conf_t  *ucscf;
-    ngx_check_conf_t                    *cf;
+    ngx_http_upstream_check_ctx_t  *ctx;
 
-    c = peer->pc.connection;
-    ucscf = peer->conf;
-    cf = ucscf->check_type_conf;
+    ctx = peer->check_data;
 
-    if (c) {
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                       "http check clean event: index:%i, fd: %d",
-                       peer->index, c->fd);
-        if (c->error == 0 &&
-            cf->need_keepalive &&
-            (c->requests < ucscf->check_keepalive_requests))
-        {
-            c->write->handler = ngx_http_upstream_check_dummy_handler;
-            c->read->handler = ngx_http_upstream_check_discard_handler;
-        } else {
-            ngx_close_connection(c);
-            peer->pc.connection = NULL;
-        }
+    if (ctx == NULL) {
+        return;
     }
 
-    if (peer->check_timeout_ev.timer_set) {
-        ngx_del_timer(&peer->check_timeout_ev);
-    }
+    peer->check_data = NULL;
 
-    peer->state = NGX_HTTP_CHECK_ALL_DONE;
+    /*
+     * Keep only the buffers of the default check_buffer_size, an ssl or
+     * an http2 connection leaves its own allocations in the pool too.
+     */
 
-    if (peer->check_data != NULL && peer->reinit) {
-        peer->reinit(peer);
+    if ((ctx->recv.start
+         && (size_t) (ctx->recv.end - ctx->recv.start) != ngx_pagesize / 2)
+        || ctx->reset_pool)
+    {
+        ngx_reset_pool(ctx->pool);
+        ngx_memzero(&ctx->recv, sizeof(ngx_buf_t));
     }
 
-    peer->shm->owner = NGX_INVALID_PID;
+    ngx_queue_insert_head(&ngx_http_upstream_check_ctx_queue, &ctx->queue);
 }
 
 
@@ -2598,12 +5790,27 @@ ngx_http_upstream_check_timeout_handler(ngx_event_t *event)
     }
 
     peer = event->data;
+
+    if (peer->state == NGX_HTTP_CHECK_RECV_DONE) {
+
+        /* the check passed, no session ticket came after it */
+
+        ngx_http_upstream_check_clean_event(peer);
+        return;
+    }
+
     peer->pc.connection->error = 1;
 
     ngx_log_error(NGX_LOG_ERR, event->log, 0,
                   "check time out with peer: %V ",
                   &peer->check_peer_addr->name);
 
+    (void) ngx_atomic_fetch_add(&peer->shm->timeouts, 1);
+
+    /* a peer too slow to answer still weighs its timeout in */
+    ngx_http_upstream_check_rtt_update(peer,
+                                       ngx_current_msec - peer->check_start);
+
     ngx_http_upstream_check_status_update(peer, 0);
     ngx_http_upstream_check_clean_event(peer);
 }
@@ -2634,7 +5841,9 @@ static void
 ngx_http_upstream_check_clear_all_events()
 {
     ngx_uint_t                       i;
+    ngx_queue_t                     *q;
     ngx_connection_t                *c;
+    ngx_http_upstream_check_ctx_t   *ctx;
     ngx_http_upstream_check_peer_t  *peer;
     ngx_http_upstream_check_peers_t *peers;
 
@@ -2651,27 +5860,31 @@ ngx_http_upstream_check_clear_all_events()
 
     peers = check_peers_ctx;
 
+    if (ngx_http_upstream_check_wheel.event.timer_set) {
+        ngx_del_timer(&ngx_http_upstream_check_wheel.event);
+    }
+
     peer = peers->peers.elts;
     for (i = 0; i < peers->peers.nelts; i++) {
 
-        if (peer[i].check_ev.timer_set) {
-            ngx_del_timer(&peer[i].check_ev);
-        }
-
         if (peer[i].check_timeout_ev.timer_set) {
             ngx_del_timer(&peer[i].check_timeout_ev);
         }
 
         c = peer[i].pc.connection;
         if (c) {
-            ngx_close_connection(c);
-            peer[i].pc.connection = NULL;
+            ngx_http_upstream_check_close_connection(&peer[i]);
         }
 
-        if (peer[i].pool != NULL) {
-            ngx_destroy_pool(peer[i].pool);
-            peer[i].pool = NULL;
-        }
+        ngx_http_upstream_check_ctx_free(&peer[i]);
+    }
+
+    while (!ngx_queue_empty(&ngx_http_upstream_check_ctx_queue)) {
+        q = ngx_queue_head(&ngx_http_upstream_check_ctx_queue);
+        ngx_queue_remove(q);
+
+        ctx = ngx_queue_data(q, ngx_http_upstream_check_ctx_t, queue);
+        ngx_destroy_pool(ctx->pool);
     }
 }
 
@@ -2679,10 +5892,9 @@ ngx_http_upstream_check_clear_all_events()
 static ngx_int_t
 ngx_http_upstream_check_status_handler(ngx_http_request_t *r)
 {
-    size_t                                 buffer_size;
     ngx_int_t                              rc;
-    ngx_buf_t                             *b;
-    ngx_chain_t                            out;
+    ngx_uint_t                             i;
+    ngx_http_upstream_check_peer_t        *peer;
     ngx_http_upstream_check_peers_t       *peers;
     ngx_http_upstream_check_loc_conf_t    *uclcf;
     ngx_http_upstream_check_status_ctx_t  *ctx;
@@ -2731,28 +5943,19 @@ ngx_http_upstream_check_status_handler(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    /* 1/4 pagesize for each record */
-    buffer_size = peers->peers.nelts * ngx_pagesize / 4;
-    buffer_size = ngx_align(buffer_size, ngx_pagesize) + ngx_pagesize;
+    ctx->peers = peers;
 
-    b = ngx_create_temp_buf(r->pool, buffer_size);
-    if (b == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+    peer = peers->peers.elts;
 
-    out.buf = b;
-    out.next = NULL;
+    for (i = 0; i < peers->peers.nelts; i++) {
+        if (ngx_http_upstream_check_status_show(ctx, &peer[i])) {
+            ctx->count++;
+        }
+    }
 
-    ctx->format->output(b, peers, ctx->flag);
+    /* the page is sent as it is rendered, without a content length */
 
     r->headers_out.status = NGX_HTTP_OK;
-    r->headers_out.content_length_n = b->last - b->pos;
-
-    if (r->headers_out.content_length_n == 0) {
-        r->header_only = 1;
-    }
-
-    b->last_buf = 1;
 
     rc = ngx_http_send_header(r);
 
@@ -2760,7 +5963,256 @@ ngx_http_upstream_check_status_handler(ngx_http_request_t *r)
         return rc;
     }
 
-    return ngx_http_output_filter(r, &out);
+    ngx_http_set_ctx(r, ctx, ngx_http_upstream_check_module);
+
+    rc = ngx_http_upstream_check_status_send(r, ctx);
+
+    if (rc == NGX_AGAIN) {
+        r->main->count++;
+        r->write_event_handler = ngx_http_upstream_check_status_write_handler;
+
+        return NGX_DONE;
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_check_status_send(ngx_http_request_t *r,
+    ngx_http_upstream_check_status_ctx_t *ctx)
+{
+    ngx_int_t                  rc;
+    ngx_chain_t               *out;
+    ngx_connection_t          *c;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = r->connection;
+    out = NULL;
+
+    for ( ;; ) {
+
+        if (out || c->buffered) {
+            rc = ngx_http_output_filter(r, out);
+
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &out,
+                             (ngx_buf_tag_t) &ngx_http_upstream_check_module);
+        }
+
+        if (ctx->state == NGX_CHECK_STATUS_ST_DONE) {
+            return NGX_OK;
+        }
+
+        /* render no more until the client has taken what is buffered */
+
+        if (c->buffered) {
+            clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+            if (!c->write->delayed) {
+                ngx_add_timer(c->write, clcf->send_timeout);
+            }
+
+            if (ngx_handle_write_event(c->write, clcf->send_lowat) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            return NGX_AGAIN;
+        }
+
+        out = ngx_http_upstream_check_status_render(r, ctx);
+        if (out == NULL) {
+            return NGX_ERROR;
+        }
+    }
+}
+
+
+static void
+ngx_http_upstream_check_status_write_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                              rc;
+    ngx_event_t                           *wev;
+    ngx_http_core_loc_conf_t              *clcf;
+    ngx_http_upstream_check_status_ctx_t  *ctx;
+
+    wev = r->connection->write;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT,
+                      "client timed out");
+
+        r->connection->timedout = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (wev->delayed) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
+
+        return;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_upstream_check_module);
+
+    rc = ngx_http_upstream_check_status_send(r, ctx);
+
+    if (rc == NGX_AGAIN) {
+        return;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    ngx_http_finalize_request(r, rc);
+}
+
+
+/*
+ * Fills a buffer of the page with whole records. A record which does not
+ * fit into an empty buffer is retried in a buffer twice as large.
+ */
+
+static ngx_chain_t *
+ngx_http_upstream_check_status_render(ngx_http_request_t *r,
+    ngx_http_upstream_check_status_ctx_t *ctx)
+{
+    size_t                                    size;
+    u_char                                   *last;
+    ngx_buf_t                                *b;
+    ngx_chain_t                              *cl;
+    ngx_http_upstream_check_peer_t           *peer;
+    ngx_http_upstream_check_status_format_pt  output;
+
+    cl = ngx_chain_get_free_buf(r->pool, &ctx->free);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    b = cl->buf;
+
+    if (b->start == NULL) {
+        b->start = ngx_palloc(r->pool, ngx_pagesize);
+        if (b->start == NULL) {
+            return NULL;
+        }
+
+        b->end = b->start + ngx_pagesize;
+        b->tag = (ngx_buf_tag_t) &ngx_http_upstream_check_module;
+        b->temporary = 1;
+    }
+
+    b->pos = b->last = b->start;
+
+    peer = ctx->peers->peers.elts;
+
+    while (ctx->state != NGX_CHECK_STATUS_ST_DONE) {
+
+        switch (ctx->state) {
+
+        case NGX_CHECK_STATUS_ST_HEADER:
+            output = ctx->format->header;
+            break;
+
+        case NGX_CHECK_STATUS_ST_PEERS:
+
+            if (ctx->index == ctx->peers->peers.nelts) {
+
+                if (++ctx->pass < ctx->format->passes) {
+                    ctx->state = NGX_CHECK_STATUS_ST_HEADER;
+                    ctx->index = 0;
+
+                } else {
+                    ctx->state = NGX_CHECK_STATUS_ST_FOOTER;
+                }
+
+                continue;
+            }
+
+            if (!ngx_http_upstream_check_status_show(ctx, &peer[ctx->index])) {
+                ctx->index++;
+                continue;
+            }
+
+            output = ctx->format->peer;
+            break;
+
+        default: /* NGX_CHECK_STATUS_ST_FOOTER */
+            output = ctx->format->footer;
+            break;
+        }
+
+        if (output) {
+            last = b->last;
+
+            output(b, ctx, ctx->index);
+
+            /* ngx_snprintf() truncates silently */
+
+            if (b->last == b->end) {
+                b->last = last;
+
+                if (last != b->start) {
+                    break;
+                }
+
+                size = (b->end - b->start) * 2;
+
+                b->start = ngx_palloc(r->pool, size);
+                if (b->start == NULL) {
+                    return NULL;
+                }
+
+                b->pos = b->last = b->start;
+                b->end = b->start + size;
+
+                continue;
+            }
+        }
+
+        if (ctx->state == NGX_CHECK_STATUS_ST_PEERS) {
+            ctx->index++;
+            ctx->shown++;
+
+        } else {
+            ctx->state++;
+        }
+    }
+
+    if (ctx->state == NGX_CHECK_STATUS_ST_DONE) {
+        b->last_buf = (r == r->main) ? 1 : 0;
+        b->last_in_chain = 1;
+
+        if (b->last == b->pos) {
+            /* an empty page, send the last buffer as a special one */
+            b->temporary = 0;
+        }
+    }
+
+    return cl;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_check_status_show(ngx_http_upstream_check_status_ctx_t *ctx,
+    ngx_http_upstream_check_peer_t *peer)
+{
+    if (ctx->flag & NGX_CHECK_STATUS_DOWN) {
+        return peer->shm->down ? 1 : 0;
+
+    } else if (ctx->flag & NGX_CHECK_STATUS_UP) {
+        return peer->shm->down ? 0 : 1;
+    }
+
+    return 1;
 }
 
 
@@ -2820,51 +6272,26 @@ ngx_http_upstream_check_status_command_status(
     if (value->len == (sizeof("down") - 1)
         && ngx_strncasecmp(value->data, (u_char *) "down", value->len) == 0) {
 
-        ctx->flag |= NGX_CHECK_STATUS_DOWN;
-
-    } else if (value->len == (sizeof("up") - 1)
-               && ngx_strncasecmp(value->data, (u_char *) "up", value->len)
-               == 0) {
-
-        ctx->flag |= NGX_CHECK_STATUS_UP;
-
-    } else {
-        return NGX_ERROR;
-    }
-
-    return NGX_OK;
-}
-
-
-static void
-ngx_http_upstream_check_status_html_format(ngx_buf_t *b,
-    ngx_http_upstream_check_peers_t *peers, ngx_uint_t flag)
-{
-    ngx_uint_t                      i, count;
-    ngx_http_upstream_check_peer_t *peer;
-
-    peer = peers->peers.elts;
-
-    count = 0;
-
-    for (i = 0; i < peers->peers.nelts; i++) {
-
-        if (flag & NGX_CHECK_STATUS_DOWN) {
-
-            if (!peer[i].shm->down) {
-                continue;
-            }
+        ctx->flag |= NGX_CHECK_STATUS_DOWN;
 
-        } else if (flag & NGX_CHECK_STATUS_UP) {
+    } else if (value->len == (sizeof("up") - 1)
+               && ngx_strncasecmp(value->data, (u_char *) "up", value->len)
+               == 0) {
 
-            if (peer[i].shm->down) {
-                continue;
-            }
-        }
+        ctx->flag |= NGX_CHECK_STATUS_UP;
 
-        count++;
+    } else {
+        return NGX_ERROR;
     }
 
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_check_status_html_header(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index)
+{
     b->last = ngx_snprintf(b->last, b->end - b->last,
             "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML 1.0 Strict//EN\n"
             "\"http://www.w3.org/TR/xhtml1/DTD/xhtml1-strict.dtd\">\n"
@@ -2886,46 +6313,61 @@ ngx_http_upstream_check_status_html_format(ngx_buf_t *b,
             "    <th>Fall counts</th>\n"
             "    <th>Check type</th>\n"
             "    <th>Check port</th>\n"
+            "    <th>Connect ms</th>\n"
+            "    <th>Send ms</th>\n"
+            "    <th>First byte ms</th>\n"
+            "    <th>Parse ms</th>\n"
             "  </tr>\n",
-            count, ngx_http_upstream_check_shm_generation);
-
-    for (i = 0; i < peers->peers.nelts; i++) {
-
-        if (flag & NGX_CHECK_STATUS_DOWN) {
+            ctx->count, ngx_http_upstream_check_shm_generation);
+}
 
-            if (!peer[i].shm->down) {
-                continue;
-            }
 
-        } else if (flag & NGX_CHECK_STATUS_UP) {
+static void
+ngx_http_upstream_check_status_html_peer(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index)
+{
+    ngx_uint_t                       i;
+    ngx_http_upstream_check_peer_t  *peer;
 
-            if (peer[i].shm->down) {
-                continue;
-            }
-        }
+    peer = ctx->peers->peers.elts;
 
+    b->last = ngx_snprintf(b->last, b->end - b->last,
+            "  <tr%s>\n"
+            "    <td>%ui</td>\n"
+            "    <td>%V</td>\n"
+            "    <td>%V</td>\n"
+            "    <td>%s</td>\n"
+            "    <td>%ui</td>\n"
+            "    <td>%ui</td>\n"
+            "    <td>%V</td>\n"
+            "    <td>%ui</td>\n",
+            peer[index].shm->down ? " bgcolor=\"#FF0000\"" : "",
+            index,
+            peer[index].upstream_name,
+            &peer[index].peer_addr->name,
+            peer[index].shm->down ? "down" : "up",
+            peer[index].shm->rise_count,
+            peer[index].shm->fall_count,
+            &peer[index].conf->check_type_conf->name,
+            peer[index].conf->port);
+
+    /* the last value and the average */
+
+    for (i = 0; i < NGX_HTTP_CHECK_PHASES; i++) {
         b->last = ngx_snprintf(b->last, b->end - b->last,
-                "  <tr%s>\n"
-                "    <td>%ui</td>\n"
-                "    <td>%V</td>\n"
-                "    <td>%V</td>\n"
-                "    <td>%s</td>\n"
-                "    <td>%ui</td>\n"
-                "    <td>%ui</td>\n"
-                "    <td>%V</td>\n"
-                "    <td>%ui</td>\n"
-                "  </tr>\n",
-                peer[i].shm->down ? " bgcolor=\"#FF0000\"" : "",
-                i,
-                peer[i].upstream_name,
-                &peer[i].peer_addr->name,
-                peer[i].shm->down ? "down" : "up",
-                peer[i].shm->rise_count,
-                peer[i].shm->fall_count,
-                &peer[i].conf->check_type_conf->name,
-                peer[i].conf->port);
+                "    <td>%uA / %uA</td>\n",
+                peer[index].shm->phase_last[i],
+                ngx_http_upstream_check_phase_avg(peer[index].shm, i));
     }
 
+    b->last = ngx_snprintf(b->last, b->end - b->last, "  </tr>\n");
+}
+
+
+static void
+ngx_http_upstream_check_status_html_footer(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index)
+{
     b->last = ngx_snprintf(b->last, b->end - b->last,
             "</table>\n"
             "</body>\n"
@@ -2934,121 +6376,246 @@ ngx_http_upstream_check_status_html_format(ngx_buf_t *b,
 
 
 static void
-ngx_http_upstream_check_status_csv_format(ngx_buf_t *b,
-    ngx_http_upstream_check_peers_t *peers, ngx_uint_t flag)
+ngx_http_upstream_check_status_csv_peer(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index)
 {
     ngx_uint_t                       i;
     ngx_http_upstream_check_peer_t  *peer;
 
-    peer = peers->peers.elts;
-    for (i = 0; i < peers->peers.nelts; i++) {
+    peer = ctx->peers->peers.elts;
 
-        if (flag & NGX_CHECK_STATUS_DOWN) {
+    b->last = ngx_snprintf(b->last, b->end - b->last,
+            "%ui,%V,%V,%s,%ui,%ui,%V,%ui",
+            index,
+            peer[index].upstream_name,
+            &peer[index].peer_addr->name,
+            peer[index].shm->down ? "down" : "up",
+            peer[index].shm->rise_count,
+            peer[index].shm->fall_count,
+            &peer[index].conf->check_type_conf->name,
+            peer[index].conf->port);
+
+    for (i = 0; i < NGX_HTTP_CHECK_PHASES; i++) {
+        b->last = ngx_snprintf(b->last, b->end - b->last, ",%uA,%uA",
+                peer[index].shm->phase_last[i],
+                ngx_http_upstream_check_phase_avg(peer[index].shm, i));
+    }
+
+    b->last = ngx_snprintf(b->last, b->end - b->last, "\n");
+}
 
-            if (!peer[i].shm->down) {
-                continue;
-            }
 
-        } else if (flag & NGX_CHECK_STATUS_UP) {
+static void
+ngx_http_upstream_check_status_json_header(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index)
+{
+    b->last = ngx_snprintf(b->last, b->end - b->last,
+            "{\"servers\": {\n"
+            "  \"total\": %ui,\n"
+            "  \"generation\": %ui,\n"
+            "  \"converging\": %uA,\n"
+            "  \"ready_time\": %M,\n"
+            "  \"server\": [\n",
+            ctx->count,
+            ngx_http_upstream_check_shm_generation,
+            ctx->peers->peers_shm->converging,
+            ctx->peers->peers_shm->ready_time);
+}
+
 
-            if (peer[i].shm->down) {
-                continue;
-            }
-        }
+static void
+ngx_http_upstream_check_status_json_peer(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index)
+{
+    ngx_uint_t                       i;
+    ngx_http_upstream_check_peer_t  *peer;
+
+    peer = ctx->peers->peers.elts;
+
+    /* the separator goes before the record, the last one is not known */
+
+    b->last = ngx_snprintf(b->last, b->end - b->last,
+            "%s"
+            "    {\"index\": %ui, "
+            "\"upstream\": \"%V\", "
+            "\"name\": \"%V\", "
+            "\"status\": \"%s\", "
+            "\"rise\": %ui, "
+            "\"fall\": %ui, "
+            "\"type\": \"%V\", "
+            "\"port\": %ui, "
+            "\"phases\": {",
+            ctx->shown ? ",\n" : "",
+            index,
+            peer[index].upstream_name,
+            &peer[index].peer_addr->name,
+            peer[index].shm->down ? "down" : "up",
+            peer[index].shm->rise_count,
+            peer[index].shm->fall_count,
+            &peer[index].conf->check_type_conf->name,
+            peer[index].conf->port);
+
+    for (i = 0; i < NGX_HTTP_CHECK_PHASES; i++) {
+        b->last = ngx_snprintf(b->last, b->end - b->last,
+                "%s\"%V\": {\"last\": %uA, \"avg\": %uA}",
+                i ? ", " : "",
+                &ngx_http_upstream_check_phase_names[i],
+                peer[index].shm->phase_last[i],
+                ngx_http_upstream_check_phase_avg(peer[index].shm, i));
+    }
+
+    b->last = ngx_snprintf(b->last, b->end - b->last, "}}");
+}
+
+
+static void
+ngx_http_upstream_check_status_json_footer(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index)
+{
+    b->last = ngx_snprintf(b->last, b->end - b->last,
+            "%s"
+            "  ]\n"
+            "}}\n",
+            ctx->shown ? "\n" : "");
+}
+
+
+static void
+ngx_http_upstream_check_status_openmetrics_header(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index)
+{
+    ngx_http_upstream_check_metric_t  *metric;
+
+    metric = &ngx_http_upstream_check_metrics[ctx->pass];
+
+    b->last = ngx_snprintf(b->last, b->end - b->last,
+            "# TYPE nginx_upstream_check_%V %V\n",
+            &metric->name, &metric->type);
 
+    if (metric->unit.len) {
         b->last = ngx_snprintf(b->last, b->end - b->last,
-                "%ui,%V,%V,%s,%ui,%ui,%V,%ui\n",
-                i,
-                peer[i].upstream_name,
-                &peer[i].peer_addr->name,
-                peer[i].shm->down ? "down" : "up",
-                peer[i].shm->rise_count,
-                peer[i].shm->fall_count,
-                &peer[i].conf->check_type_conf->name,
-                peer[i].conf->port);
+                "# UNIT nginx_upstream_check_%V %V\n",
+                &metric->name, &metric->unit);
     }
+
+    b->last = ngx_snprintf(b->last, b->end - b->last,
+            "# HELP nginx_upstream_check_%V %V\n",
+            &metric->name, &metric->help);
 }
 
 
+#define NGX_HTTP_CHECK_METRIC_LABELS                                          \
+    "upstream=\"%V\",name=\"%V\",type=\"%V\""
+
 static void
-ngx_http_upstream_check_status_json_format(ngx_buf_t *b,
-    ngx_http_upstream_check_peers_t *peers, ngx_uint_t flag)
+ngx_http_upstream_check_status_openmetrics_peer(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index)
 {
-    ngx_uint_t                       count, i, last;
-    ngx_http_upstream_check_peer_t  *peer;
+    ngx_uint_t                           i, value, count;
+    ngx_str_t                           *name, *upstream, *type;
+    ngx_http_upstream_check_peer_t      *peer;
+    ngx_http_upstream_check_peer_shm_t  *shm;
+    ngx_http_upstream_check_metric_t    *metric;
 
-    peer = peers->peers.elts;
+    peer = ctx->peers->peers.elts;
 
-    count = 0;
+    shm = peer[index].shm;
+    metric = &ngx_http_upstream_check_metrics[ctx->pass];
 
-    for (i = 0; i < peers->peers.nelts; i++) {
+    upstream = peer[index].upstream_name;
+    name = &peer[index].peer_addr->name;
+    type = &peer[index].conf->check_type_conf->name;
 
-        if (flag & NGX_CHECK_STATUS_DOWN) {
+    switch (ctx->pass) {
 
-            if (!peer[i].shm->down) {
-                continue;
-            }
+    case NGX_HTTP_CHECK_METRIC_UP:
+        value = shm->down ? 0 : 1;
+        break;
 
-        } else if (flag & NGX_CHECK_STATUS_UP) {
+    case NGX_HTTP_CHECK_METRIC_RISE:
+        value = shm->rise_count;
+        break;
 
-            if (peer[i].shm->down) {
-                continue;
-            }
-        }
+    case NGX_HTTP_CHECK_METRIC_FALL:
+        value = shm->fall_count;
+        break;
 
-        count++;
-    }
+    case NGX_HTTP_CHECK_METRIC_CHECKS:
+        value = shm->checks;
+        break;
 
-    b->last = ngx_snprintf(b->last, b->end - b->last,
-            "{\"servers\": {\n"
-            "  \"total\": %ui,\n"
-            "  \"generation\": %ui,\n"
-            "  \"server\": [\n",
-            count,
-            ngx_http_upstream_check_shm_generation);
+    case NGX_HTTP_CHECK_METRIC_FAILURES:
+        value = shm->failures;
+        break;
 
-    last = peers->peers.nelts - 1;
-    for (i = 0; i < peers->peers.nelts; i++) {
+    case NGX_HTTP_CHECK_METRIC_TIMEOUTS:
+        value = shm->timeouts;
+        break;
 
-        if (flag & NGX_CHECK_STATUS_DOWN) {
+    case NGX_HTTP_CHECK_METRIC_REQUESTS:
+        value = ctx->peers->peers_shm->stats[index].access_count;
+        break;
 
-            if (!peer[i].shm->down) {
-                continue;
-            }
+    case NGX_HTTP_CHECK_METRIC_PHASE:
+    case NGX_HTTP_CHECK_METRIC_PHASE_AVG:
 
-        } else if (flag & NGX_CHECK_STATUS_UP) {
+        for (i = 0; i < NGX_HTTP_CHECK_PHASES; i++) {
+            value = (ctx->pass == NGX_HTTP_CHECK_METRIC_PHASE)
+                    ? shm->phase_last[i]
+                    : ngx_http_upstream_check_phase_avg(shm, i);
 
-            if (peer[i].shm->down) {
-                continue;
-            }
+            b->last = ngx_snprintf(b->last, b->end - b->last,
+                    "nginx_upstream_check_%V{" NGX_HTTP_CHECK_METRIC_LABELS
+                    ",phase=\"%V\"} %ui.%03ui\n",
+                    &metric->name, upstream, name, type,
+                    &ngx_http_upstream_check_phase_names[i],
+                    value / 1000, value % 1000);
+        }
+
+        return;
+
+    default: /* NGX_HTTP_CHECK_METRIC_DURATION */
+
+        count = 0;
+
+        for (i = 0; i < NGX_HTTP_CHECK_DURATION_BUCKETS; i++) {
+            count += shm->duration[i];
+
+            b->last = ngx_snprintf(b->last, b->end - b->last,
+                    "nginx_upstream_check_%V_bucket{"
+                    NGX_HTTP_CHECK_METRIC_LABELS ",le=\"%s\"} %ui\n",
+                    &metric->name, upstream, name, type,
+                    ngx_http_upstream_check_duration_buckets[i].le, count);
         }
 
+        value = shm->duration_sum;
+
         b->last = ngx_snprintf(b->last, b->end - b->last,
-                "    {\"index\": %ui, "
-                "\"upstream\": \"%V\", "
-                "\"name\": \"%V\", "
-                "\"status\": \"%s\", "
-                "\"rise\": %ui, "
-                "\"fall\": %ui, "
-                "\"type\": \"%V\", "
-                "\"port\": %ui}"
-                "%s\n",
-                i,
-                peer[i].upstream_name,
-                &peer[i].peer_addr->name,
-                peer[i].shm->down ? "down" : "up",
-                peer[i].shm->rise_count,
-                peer[i].shm->fall_count,
-                &peer[i].conf->check_type_conf->name,
-                peer[i].conf->port,
-                (i == last) ? "" : ",");
+                "nginx_upstream_check_%V_sum{" NGX_HTTP_CHECK_METRIC_LABELS
+                "} %ui.%03ui\n"
+                "nginx_upstream_check_%V_count{" NGX_HTTP_CHECK_METRIC_LABELS
+                "} %ui\n",
+                &metric->name, upstream, name, type,
+                value / 1000, value % 1000,
+                &metric->name, upstream, name, type, count);
+
+        return;
     }
 
     b->last = ngx_snprintf(b->last, b->end - b->last,
-            "  ]\n");
+            "nginx_upstream_check_%V%s{" NGX_HTTP_CHECK_METRIC_LABELS
+            "} %ui\n",
+            &metric->name,
+            metric->counter ? "_total" : "",
+            upstream, name, type, value);
+}
 
-    b->last = ngx_snprintf(b->last, b->end - b->last,
-            "}}\n");
+
+static void
+ngx_http_upstream_check_status_openmetrics_footer(ngx_buf_t *b,
+    ngx_http_upstream_check_status_ctx_t *ctx, ngx_uint_t index)
+{
+    b->last = ngx_snprintf(b->last, b->end - b->last, "# EOF\n");
 }
 
 
@@ -3083,7 +6650,9 @@ ngx_http_upstream_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_str_t                           *value, s;
     ngx_uint_t                           i, port, rise, fall, default_down;
-    ngx_msec_t                           interval, timeout;
+    ngx_uint_t                           fast_start;
+    ngx_msec_t                           interval, interval_min, interval_max;
+    ngx_msec_t                           timeout, slow_start;
     ngx_http_upstream_check_srv_conf_t  *ucscf;
 
     /* default values */
@@ -3091,8 +6660,12 @@ ngx_http_upstream_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     rise = 2;
     fall = 5;
     interval = 30000;
+    interval_min = NGX_CONF_UNSET_MSEC;
+    interval_max = NGX_CONF_UNSET_MSEC;
     timeout = 1000;
+    slow_start = 0;
     default_down = 1;
+    fast_start = 0;
 
     value = cf->args->elts;
 
@@ -3141,6 +6714,30 @@ ngx_http_upstream_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "interval_min=", 13) == 0) {
+            s.len = value[i].len - 13;
+            s.data = value[i].data + 13;
+
+            interval_min = ngx_atoi(s.data, s.len);
+            if (interval_min == (ngx_msec_t) NGX_ERROR || interval_min == 0) {
+                goto invalid_check_parameter;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval_max=", 13) == 0) {
+            s.len = value[i].len - 13;
+            s.data = value[i].data + 13;
+
+            interval_max = ngx_atoi(s.data, s.len);
+            if (interval_max == (ngx_msec_t) NGX_ERROR || interval_max == 0) {
+                goto invalid_check_parameter;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
             s.len = value[i].len - 8;
             s.data = value[i].data + 8;
@@ -3153,6 +6750,18 @@ ngx_http_upstream_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "slow_start=", 11) == 0) {
+            s.len = value[i].len - 11;
+            s.data = value[i].data + 11;
+
+            slow_start = ngx_atoi(s.data, s.len);
+            if (slow_start == (ngx_msec_t) NGX_ERROR) {
+                goto invalid_check_parameter;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "rise=", 5) == 0) {
             s.len = value[i].len - 5;
             s.data = value[i].data + 5;
@@ -3196,15 +6805,48 @@ ngx_http_upstream_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "fast_start=", 11) == 0) {
+            s.len = value[i].len - 11;
+            s.data = value[i].data + 11;
+
+            if (ngx_strcasecmp(s.data, (u_char *) "true") == 0) {
+                fast_start = 1;
+            } else if (ngx_strcasecmp(s.data, (u_char *) "false") == 0) {
+                fast_start = 0;
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid value \"%s\", "
+                                   "it must be \"true\" or \"false\"",
+                                   value[i].data);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         goto invalid_check_parameter;
     }
 
+    ngx_conf_init_msec_value(interval_min, interval);
+    ngx_conf_init_msec_value(interval_max, interval);
+
+    if (interval_min > interval || interval_max < interval) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"interval\" must be between \"interval_min\" "
+                           "and \"interval_max\"");
+        return NGX_CONF_ERROR;
+    }
+
     ucscf->port = port;
     ucscf->check_interval = interval;
+    ucscf->check_interval_min = interval_min;
+    ucscf->check_interval_max = interval_max;
     ucscf->check_timeout = timeout;
+    ucscf->slow_start = slow_start;
     ucscf->fall_count = fall;
     ucscf->rise_count = rise;
     ucscf->default_down = default_down;
+    ucscf->fast_start = fast_start;
 
     if (ucscf->check_type_conf == NGX_CONF_UNSET_PTR) {
         ngx_str_set(&s, "tcp");
@@ -3230,18 +6872,136 @@ ngx_http_upstream_check_keepalive_requests(ngx_conf_t *cf, ngx_command_t *cmd,
     ngx_http_upstream_check_srv_conf_t  *ucscf;
     ngx_uint_t                           requests;
 
-    value = cf->args->elts;
+    value = cf->args->elts;
+
+    ucscf = ngx_http_conf_get_module_srv_conf(cf,
+                                              ngx_http_upstream_check_module);
+
+    requests = ngx_atoi(value[1].data, value[1].len);
+    if (requests == (ngx_uint_t) NGX_ERROR || requests == 0) {
+        return "invalid value";
+    }
+
+    ucscf->check_keepalive_requests = requests;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_check_passive(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_str_t                           *value, s;
+    ngx_uint_t                           i;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    value = cf->args->elts;
+
+    ucscf = ngx_http_conf_get_module_srv_conf(cf,
+                                              ngx_http_upstream_check_module);
+
+    if (ucscf->passive_fails) {
+        return "is duplicate";
+    }
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            ucscf->passive_fails = ngx_atoi(s.data, s.len);
+            if (ucscf->passive_fails == (ngx_uint_t) NGX_ERROR
+                || ucscf->passive_fails == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "window=", 7) == 0) {
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            ucscf->passive_window = ngx_atoi(s.data, s.len);
+            if (ucscf->passive_window == (ngx_msec_t) NGX_ERROR
+                || ucscf->passive_window == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "slow=", 5) == 0) {
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            ucscf->passive_slow = ngx_atoi(s.data, s.len);
+            if (ucscf->passive_slow == (ngx_msec_t) NGX_ERROR
+                || ucscf->passive_slow == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (ucscf->passive_fails == 0 || ucscf->passive_window == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"fails\" and \"window\" must be specified");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_check_max_inflight(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_str_t                            *value;
+    ngx_uint_t                           *max;
+    ngx_http_upstream_check_srv_conf_t   *ucscf;
+    ngx_http_upstream_check_main_conf_t  *ucmcf;
+
+    /* the limit of the worker at http level, of the upstream in it */
+
+    if (cf->cmd_type == NGX_HTTP_UPS_CONF) {
+        ucscf = ngx_http_conf_get_module_srv_conf(cf,
+                                              ngx_http_upstream_check_module);
+        max = &ucscf->check_max_inflight;
+
+    } else {
+        ucmcf = ngx_http_conf_get_module_main_conf(cf,
+                                              ngx_http_upstream_check_module);
+        max = &ucmcf->check_max_inflight;
+    }
+
+    if (*max != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
 
-    ucscf = ngx_http_conf_get_module_srv_conf(cf,
-                                              ngx_http_upstream_check_module);
+    value = cf->args->elts;
 
-    requests = ngx_atoi(value[1].data, value[1].len);
-    if (requests == (ngx_uint_t) NGX_ERROR || requests == 0) {
+    *max = ngx_atoi(value[1].data, value[1].len);
+    if (*max == (ngx_uint_t) NGX_ERROR || *max == 0) {
         return "invalid value";
     }
 
-    ucscf->check_keepalive_requests = requests;
-
     return NGX_CONF_OK;
 }
 
@@ -3438,6 +7198,9 @@ ngx_http_upstream_check_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    ucmcf->check_shard = NGX_CONF_UNSET;
+    ucmcf->check_max_inflight = NGX_CONF_UNSET_UINT;
+
     ucmcf->peers->checksum = 0;
 
     if (ngx_array_init(&ucmcf->peers->peers, cf->pool, 16,
@@ -3486,7 +7249,7 @@ ngx_http_upstream_check_create_fastcgi_request(ngx_pool_t *pool,
         return NULL;
     }
 
-    ngx_http_fastcgi_request_start.br.flags = 0;
+    ngx_http_fastcgi_request_start.br.flags = NGX_HTTP_FASTCGI_KEEP_CONN;
 
     ngx_memcpy(b->pos, &ngx_http_fastcgi_request_start,
                sizeof(ngx_http_fastcgi_request_start_t));
@@ -3559,13 +7322,17 @@ ngx_http_upstream_check_create_fastcgi_request(ngx_pool_t *pool,
 static char *
 ngx_http_upstream_check_init_main_conf(ngx_conf_t *cf, void *conf)
 {
-    ngx_buf_t                      *b;
-    ngx_uint_t                      i;
-    ngx_http_upstream_srv_conf_t  **uscfp;
-    ngx_http_upstream_main_conf_t  *umcf;
+    ngx_buf_t                            *b;
+    ngx_uint_t                            i;
+    ngx_http_upstream_srv_conf_t        **uscfp;
+    ngx_http_upstream_main_conf_t        *umcf;
+    ngx_http_upstream_check_main_conf_t  *ucmcf = conf;
 
     umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
 
+    ngx_conf_init_value(ucmcf->check_shard, 0);
+    ngx_conf_init_uint_value(ucmcf->check_max_inflight, 0);
+
     b = ngx_http_upstream_check_create_fastcgi_request(cf->pool,
             fastcgi_default_params,
             sizeof(fastcgi_default_params) / sizeof(ngx_str_t) / 2);
@@ -3586,6 +7353,10 @@ ngx_http_upstream_check_init_main_conf(ngx_conf_t *cf, void *conf)
         }
     }
 
+    if (ngx_http_upstream_check_dedup_peers(cf, ucmcf->peers) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
     return ngx_http_upstream_check_init_shm(cf, conf);
 }
 
@@ -3610,7 +7381,13 @@ ngx_http_upstream_check_create_srv_conf(ngx_conf_t *cf)
     ucscf->rise_count = NGX_CONF_UNSET_UINT;
     ucscf->check_timeout = NGX_CONF_UNSET_MSEC;
     ucscf->check_keepalive_requests = NGX_CONF_UNSET_UINT;
+    ucscf->check_buffer_size = NGX_CONF_UNSET_SIZE;
+    ucscf->check_max_inflight = NGX_CONF_UNSET_UINT;
     ucscf->check_type_conf = NGX_CONF_UNSET_PTR;
+    ucscf->redis_role = NGX_CONF_UNSET_UINT;
+#if (NGX_HTTP_SSL)
+    ucscf->ssl_verify = NGX_CONF_UNSET;
+#endif
 
     return ucscf;
 }
@@ -3667,8 +7444,12 @@ ngx_http_upstream_check_init_srv_conf(ngx_conf_t *cf, void *conf)
         ucscf->check_timeout = 1000;
     }
 
-    if (ucscf->check_keepalive_requests == NGX_CONF_UNSET_UINT) {
-        ucscf->check_keepalive_requests = 1;
+    if (ucscf->check_buffer_size == NGX_CONF_UNSET_SIZE) {
+        ucscf->check_buffer_size = ngx_pagesize / 2;
+    }
+
+    if (ucscf->check_max_inflight == NGX_CONF_UNSET_UINT) {
+        ucscf->check_max_inflight = 0;
     }
 
     if (ucscf->check_type_conf == NGX_CONF_UNSET_PTR) {
@@ -3677,6 +7458,19 @@ ngx_http_upstream_check_init_srv_conf(ngx_conf_t *cf, void *conf)
 
     check = ucscf->check_type_conf;
 
+    if (ucscf->check_keepalive_requests == NGX_CONF_UNSET_UINT) {
+        ucscf->check_keepalive_requests = 1;
+    }
+
+    ngx_conf_init_uint_value(ucscf->redis_role, 0);
+
+    if (ucscf->grpc_service.len >= NGX_HTTP_CHECK_GRPC_MAX_NAME) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the \"check_grpc_service\" name \"%V\" "
+                           "is too long", &ucscf->grpc_service);
+        return NGX_CONF_ERROR;
+    }
+
     if (check) {
         if (ucscf->send.len == 0) {
             ngx_str_set(&s, "fastcgi");
@@ -3698,6 +7492,12 @@ ngx_http_upstream_check_init_srv_conf(ngx_conf_t *cf, void *conf)
                     ucscf->send.data = b->pos;
                     ucscf->send.len = b->last - b->pos;
                 }
+            } else if (check->type == NGX_HTTP_CHECK_REDIS
+                       && ucscf->redis_role)
+            {
+                /* both commands in a single write and round trip */
+                ngx_str_set(&ucscf->send, "PING\r\nROLE\r\n");
+
             } else {
                 ucscf->send.data = check->default_send.data;
                 ucscf->send.len = check->default_send.len;
@@ -3710,10 +7510,97 @@ ngx_http_upstream_check_init_srv_conf(ngx_conf_t *cf, void *conf)
         }
     }
 
+#if (NGX_HTTP_SSL)
+
+    ngx_conf_init_value(ucscf->ssl_verify, 0);
+
+    if (check
+        && (check->type & (NGX_HTTP_CHECK_HTTPS|NGX_HTTP_CHECK_GRPCS)))
+    {
+        if (ngx_http_upstream_check_init_ssl(cf, ucscf) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    /* the name is the :authority of the grpc calls too */
+
+    if (check && check->type == NGX_HTTP_CHECK_GRPCS
+        && ucscf->ssl_name.len >= NGX_HTTP_CHECK_GRPC_MAX_NAME)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the \"check_ssl_name\" name \"%V\" "
+                           "is too long", &ucscf->ssl_name);
+        return NGX_CONF_ERROR;
+    }
+
+#endif
+
     return NGX_CONF_OK;
 }
 
 
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_upstream_check_init_ssl(ngx_conf_t *cf,
+    ngx_http_upstream_check_srv_conf_t *ucscf)
+{
+    ngx_uint_t           protocols;
+    ngx_pool_cleanup_t  *cln;
+
+    ucscf->ssl = ngx_pcalloc(cf->pool, sizeof(ngx_ssl_t));
+    if (ucscf->ssl == NULL) {
+        return NGX_ERROR;
+    }
+
+    ucscf->ssl->log = cf->log;
+
+    protocols = NGX_SSL_TLSv1 | NGX_SSL_TLSv1_1 | NGX_SSL_TLSv1_2;
+#ifdef NGX_SSL_TLSv1_3
+    protocols |= NGX_SSL_TLSv1_3;
+#endif
+
+    if (ngx_ssl_create(ucscf->ssl, protocols, NULL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        ngx_ssl_cleanup_ctx(ucscf->ssl);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_ssl_cleanup_ctx;
+    cln->data = ucscf->ssl;
+
+    /* the sessions are saved per peer to resume the next checks */
+
+    if (ngx_ssl_client_session_cache(cf, ucscf->ssl, 1) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ucscf->ssl_verify && ucscf->ssl_trusted_certificate.len == 0) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "no \"check_ssl_trusted_certificate\" is defined for "
+                      "the \"check_ssl_verify\" directive");
+        return NGX_ERROR;
+    }
+
+    if (ucscf->ssl_trusted_certificate.len
+        && ngx_ssl_trusted_certificate(cf, ucscf->ssl,
+                                       &ucscf->ssl_trusted_certificate,
+                                       NGX_HTTP_CHECK_SSL_VERIFY_DEPTH)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
 static char *
 ngx_http_upstream_check_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child)
@@ -3729,11 +7616,164 @@ ngx_http_upstream_check_merge_loc_conf(ngx_conf_t *cf, void *parent,
 }
 
 
+/*
+ * The same server is often listed in several upstreams, the peers with
+ * the same check address and the same check share the checks and the
+ * state of the first one. Only the checks done are shared, each peer
+ * keeps its index, its down bit and its request counters.
+ */
+
+static ngx_int_t
+ngx_http_upstream_check_dedup_peers(ngx_conf_t *cf,
+    ngx_http_upstream_check_peers_t *peers)
+{
+    uint32_t                         hash;
+    ngx_uint_t                       i, k, size, number, aliases;
+    ngx_uint_t                      *buckets, *next;
+    ngx_http_upstream_check_peer_t  *peer, *last;
+
+    number = peers->peers.nelts;
+    if (number < 2) {
+        return NGX_OK;
+    }
+
+    for (size = 1; size < number; size <<= 1) { /* void */ }
+
+    /* the indexes are stored + 1, 0 ends a chain */
+
+    buckets = ngx_pcalloc(cf->temp_pool, size * sizeof(ngx_uint_t));
+    next = ngx_pcalloc(cf->temp_pool, number * sizeof(ngx_uint_t));
+
+    if (buckets == NULL || next == NULL) {
+        return NGX_ERROR;
+    }
+
+    peer = peers->peers.elts;
+    aliases = 0;
+
+    for (i = 0; i < number; i++) {
+
+        hash = ngx_murmur_hash2(peer[i].check_peer_addr->name.data,
+                                peer[i].check_peer_addr->name.len);
+
+        for (k = buckets[hash & (size - 1)]; k; k = next[k - 1]) {
+            if (ngx_http_upstream_check_same_check(&peer[k - 1], &peer[i])) {
+                break;
+            }
+        }
+
+        if (k == 0) {
+            next[i] = buckets[hash & (size - 1)];
+            buckets[hash & (size - 1)] = i + 1;
+            continue;
+        }
+
+        for (last = &peer[k - 1]; last->alias_next; last = last->alias_next) {
+            /* void */
+        }
+
+        last->alias_next = &peer[i];
+        peer[i].primary = &peer[k - 1];
+
+        aliases++;
+    }
+
+    if (aliases) {
+        ngx_log_error(NGX_LOG_NOTICE, cf->log, 0,
+                      "http upstream check, %ui of %ui peers share "
+                      "the checks of others", aliases, number);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_check_same_check(ngx_http_upstream_check_peer_t *a,
+    ngx_http_upstream_check_peer_t *b)
+{
+    ngx_http_upstream_check_srv_conf_t  *ca, *cb;
+
+    if (a->check_peer_addr->name.len != b->check_peer_addr->name.len
+        || ngx_strncmp(a->check_peer_addr->name.data,
+                       b->check_peer_addr->name.data,
+                       a->check_peer_addr->name.len) != 0)
+    {
+        return 0;
+    }
+
+    ca = a->conf;
+    cb = b->conf;
+
+    if (ca == cb) {
+        return 1;
+    }
+
+    /* everything that decides on the state of the peer has to match */
+
+    if (!(ca->check_type_conf == cb->check_type_conf
+          && ca->send.len == cb->send.len
+          && ngx_memcmp(ca->send.data, cb->send.data, ca->send.len) == 0
+          && ca->code.status_alive == cb->code.status_alive
+          && ca->redis_role == cb->redis_role
+          && ca->grpc_service.len == cb->grpc_service.len
+          && ngx_memcmp(ca->grpc_service.data, cb->grpc_service.data,
+                        ca->grpc_service.len) == 0
+          && ca->check_interval == cb->check_interval
+          && ca->check_interval_min == cb->check_interval_min
+          && ca->check_interval_max == cb->check_interval_max
+          && ca->check_timeout == cb->check_timeout
+          && ca->rise_count == cb->rise_count
+          && ca->fall_count == cb->fall_count
+          && ca->default_down == cb->default_down
+          && ca->fast_start == cb->fast_start
+          && ca->slow_start == cb->slow_start
+          && ca->passive_fails == cb->passive_fails
+          && ca->passive_window == cb->passive_window
+          && ca->passive_slow == cb->passive_slow
+          && ca->check_buffer_size == cb->check_buffer_size
+          && ca->check_keepalive_requests == cb->check_keepalive_requests))
+    {
+        return 0;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (ca->ssl_verify != cb->ssl_verify
+        || ca->ssl_name.len != cb->ssl_name.len
+        || ngx_strncmp(ca->ssl_name.data, cb->ssl_name.data,
+                       ca->ssl_name.len) != 0
+        || ca->ssl_trusted_certificate.len != cb->ssl_trusted_certificate.len
+        || ngx_strncmp(ca->ssl_trusted_certificate.data,
+                       cb->ssl_trusted_certificate.data,
+                       ca->ssl_trusted_certificate.len) != 0)
+    {
+        return 0;
+    }
+
+    /* the certificate is verified against the upstream name by default */
+
+    if (ca->ssl_verify
+        && ca->ssl_name.len == 0
+        && (a->upstream_name->len != b->upstream_name->len
+            || ngx_strncmp(a->upstream_name->data, b->upstream_name->data,
+                           a->upstream_name->len) != 0))
+    {
+        return 0;
+    }
+
+#endif
+
+    return 1;
+}
+
+
 static char *
 ngx_http_upstream_check_init_shm(ngx_conf_t *cf, void *conf)
 {
+    size_t                                size, map, stats, addrs;
     ngx_str_t                            *shm_name;
-    ngx_uint_t                            shm_size;
+    ngx_uint_t                            shm_size, pages;
     ngx_shm_zone_t                       *shm_zone;
     ngx_http_upstream_check_main_conf_t  *ucmcf = conf;
 
@@ -3746,8 +7786,20 @@ ngx_http_upstream_check_init_shm(ngx_conf_t *cf, void *conf)
         ngx_http_upstream_check_get_shm_name(shm_name, cf->pool,
                                     ngx_http_upstream_check_shm_generation);
 
+        size = ngx_http_upstream_check_shm_layout(ucmcf->peers, &map, &stats,
+                                                  &addrs);
+
+        /*
+         * The peers take one slab allocation of whole pages, the slab pool
+         * puts its header and a descriptor for each page before them.
+         */
+        pages = ngx_align(size, ngx_pagesize) / ngx_pagesize;
+
+        shm_size = (pages + 8) * ngx_pagesize
+                   + ngx_align(pages * sizeof(ngx_slab_page_t), ngx_pagesize);
+
         /* The default check shared memory size is 1M */
-        shm_size = 1 * 1024 * 1024;
+        shm_size = ngx_max(shm_size, 1 * 1024 * 1024);
 
         shm_size = shm_size < ucmcf->check_shm_size ?
                               ucmcf->check_shm_size : shm_size;
@@ -3792,13 +7844,60 @@ ngx_http_upstream_check_get_shm_name(ngx_str_t *shm_name, ngx_pool_t *pool,
 }
 
 
+/*
+ * All the peers of a generation live in one block:
+ *
+ *     peers_shm header and the peer array
+ *     down bitmap
+ *     per peer request counters, a cache line each
+ *     sockaddrs of the peers, in the peer order
+ *
+ * Returns the size of the block and the offsets of its parts.
+ */
+
+static size_t
+ngx_http_upstream_check_shm_layout(ngx_http_upstream_check_peers_t *peers,
+    size_t *map, size_t *stats, size_t *addrs)
+{
+    size_t                           size;
+    ngx_uint_t                       i, number;
+    ngx_http_upstream_check_peer_t  *peer;
+
+    number = peers->peers.nelts;
+    peer = peers->peers.elts;
+
+    size = sizeof(ngx_http_upstream_check_peers_shm_t)
+           + (number - 1) * sizeof(ngx_http_upstream_check_peer_shm_t);
+
+    *map = ngx_align(size, NGX_CPU_CACHE_LINE);
+
+    size = *map + (number + NGX_HTTP_CHECK_MAP_WORD_BITS - 1)
+                  / NGX_HTTP_CHECK_MAP_WORD_BITS * sizeof(ngx_atomic_t);
+
+    *stats = ngx_align(size, NGX_CPU_CACHE_LINE);
+
+    size = *stats + number * sizeof(ngx_http_upstream_check_peer_stat_t);
+
+    *addrs = size;
+
+    for (i = 0; i < number; i++) {
+        size += ngx_align(peer[i].peer_addr->socklen, NGX_ALIGNMENT);
+    }
+
+    return size;
+}
+
+
 static ngx_int_t
 ngx_http_upstream_check_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
-    size_t                               size;
+    size_t                               size, map, stats, addrs;
+    u_char                              *addr;
+    uint32_t                             hash;
     ngx_str_t                            oshm_name;
     ngx_int_t                            rc;
-    ngx_uint_t                           i, same, number;
+    ngx_msec_t                           start;
+    ngx_uint_t                           i, k, same, number, inherited, fast;
     ngx_pool_t                          *pool;
     ngx_shm_zone_t                      *oshm_zone;
     ngx_slab_pool_t                     *shpool;
@@ -3807,9 +7906,14 @@ ngx_http_upstream_check_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data)
     ngx_http_upstream_check_srv_conf_t  *ucscf;
     ngx_http_upstream_check_peer_shm_t  *peer_shm, *opeer_shm;
     ngx_http_upstream_check_peers_shm_t *peers_shm, *opeers_shm;
+    ngx_http_upstream_check_shm_index_t  index;
 
     opeers_shm = NULL;
     peers_shm = NULL;
+    addr = NULL;
+    inherited = 0;
+    fast = 0;
+    start = 0;
     ngx_str_null(&oshm_name);
 
     same = 0;
@@ -3863,9 +7967,13 @@ ngx_http_upstream_check_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data)
             }
         }
 
-        size = sizeof(*peers_shm) +
-               (number - 1) * sizeof(ngx_http_upstream_check_peer_shm_t);
+        size = ngx_http_upstream_check_shm_layout(peers, &map, &stats, &addrs);
 
+        /*
+         * The slab allocator aligns the chunks to their size and
+         * the larger blocks to the page, so each part stays cache line
+         * aligned within the block.
+         */
         peers_shm = ngx_slab_alloc(shpool, size);
 
         if (peers_shm == NULL) {
@@ -3873,6 +7981,24 @@ ngx_http_upstream_check_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data)
         }
 
         ngx_memzero(peers_shm, size);
+
+        peers_shm->down_map = (ngx_atomic_t *) ((u_char *) peers_shm + map);
+        peers_shm->stats = (ngx_http_upstream_check_peer_stat_t *)
+                               ((u_char *) peers_shm + stats);
+
+        addr = (u_char *) peers_shm + addrs;
+
+        if (opeers_shm) {
+            ngx_time_update();
+            start = ngx_current_msec;
+
+            if (ngx_http_upstream_check_shm_index_init(&index, opeers_shm,
+                                                       shm_zone->shm.log)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
     }
 
     peers_shm->generation = ngx_http_upstream_check_shm_generation;
@@ -3892,31 +8018,64 @@ ngx_http_upstream_check_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data)
          */
         peer_shm->owner = NGX_INVALID_PID;
 
+        k = peer[i].primary ? peer[i].primary->index + 1 : 0;
+
         if (same) {
+
+            /* a former alias checked on its own takes over the state */
+
+            if (peer_shm->alias && k == 0) {
+                opeer_shm = &peers_shm->peers[peer_shm->alias - 1];
+
+                peer_shm->access_time = opeer_shm->access_time;
+                peer_shm->fall_count = opeer_shm->fall_count;
+                peer_shm->rise_count = opeer_shm->rise_count;
+                peer_shm->down = opeer_shm->down;
+            }
+
+            peer_shm->alias = k;
             continue;
         }
 
+        peer_shm->alias = k;
+
         peer_shm->socklen = peer[i].peer_addr->socklen;
-        peer_shm->sockaddr = ngx_slab_alloc(shpool, peer_shm->socklen);
-        if (peer_shm->sockaddr == NULL) {
-            goto failure;
-        }
+        peer_shm->sockaddr = (struct sockaddr *) addr;
+
+        addr += ngx_align(peer_shm->socklen, NGX_ALIGNMENT);
 
         ngx_memcpy(peer_shm->sockaddr, peer[i].peer_addr->sockaddr,
                    peer_shm->socklen);
 
+        hash = ngx_murmur_hash2(peer[i].upstream_name->data,
+                                peer[i].upstream_name->len);
+        peer_shm->upstream_hash = hash;
+
         if (opeers_shm) {
 
-            opeer_shm = ngx_http_upstream_check_find_shm_peer(opeers_shm,
-                                                              peer[i].peer_addr);
+            opeer_shm = ngx_http_upstream_check_find_shm_peer(&index,
+                                                              peer[i].peer_addr,
+                                                              hash);
             if (opeer_shm) {
                 ngx_log_debug1(NGX_LOG_DEBUG_HTTP, shm_zone->shm.log, 0,
                                "http upstream check, inherit opeer: %V ",
                                &peer[i].peer_addr->name);
 
+                inherited++;
+
+                peers_shm->stats[i].access_count =
+                    opeers_shm->stats[opeer_shm - opeers_shm->peers].access_count;
+
+                /* the state of an old alias is kept by its primary */
+
+                if (opeer_shm->alias) {
+                    opeer_shm = &opeers_shm->peers[opeer_shm->alias - 1];
+                }
+
                 rc = ngx_http_upstream_check_init_shm_peer(peer_shm, opeer_shm,
                          0, pool, &peer[i].peer_addr->name);
                 if (rc != NGX_OK) {
+                    ngx_free(index.buckets);
                     return NGX_ERROR;
                 }
 
@@ -3929,8 +8088,46 @@ ngx_http_upstream_check_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data)
                                                    ucscf->default_down, pool,
                                                    &peer[i].peer_addr->name);
         if (rc != NGX_OK) {
+            if (opeers_shm && !same) {
+                ngx_free(index.buckets);
+            }
+
             return NGX_ERROR;
         }
+
+        if (ucscf->fast_start && ucscf->default_down && !peer[i].primary) {
+            peer_shm->fast_start = 1;
+            fast++;
+        }
+    }
+
+    if (fast) {
+        ngx_time_update();
+
+        peers_shm->converging = fast;
+        peers_shm->converge_start = ngx_current_msec;
+
+    } else if (opeers_shm && !same) {
+
+        /* the inherited peers do not start again, the last time still holds */
+
+        peers_shm->ready_time = opeers_shm->ready_time;
+    }
+
+    if (opeers_shm && !same) {
+        ngx_free(index.buckets);
+
+        ngx_time_update();
+
+        ngx_log_error(NGX_LOG_NOTICE, shm_zone->shm.log, 0,
+                      "http upstream check, inherited %ui of %ui peers "
+                      "in %Mms", inherited, number, ngx_current_msec - start);
+    }
+
+    for (i = 0; i < number; i++) {
+        k = peer[i].primary ? peer[i].primary->index : i;
+
+        ngx_http_upstream_check_map_set(peers_shm, i, peers_shm->peers[k].down);
     }
 
     peers->peers_shm = peers_shm;
@@ -3987,27 +8184,80 @@ ngx_shared_memory_find(ngx_cycle_t *cycle, ngx_str_t *name, void *tag)
 }
 
 
+static ngx_int_t
+ngx_http_upstream_check_shm_index_init(
+    ngx_http_upstream_check_shm_index_t *index,
+    ngx_http_upstream_check_peers_shm_t *peers_shm, ngx_log_t *log)
+{
+    ngx_uint_t                           i, n, key;
+    ngx_http_upstream_check_peer_shm_t  *peer_shm;
+
+    for (n = 1; n < peers_shm->number; n <<= 1) { /* void */ }
+
+    index->buckets = ngx_alloc((n + peers_shm->number) * sizeof(ngx_uint_t),
+                               log);
+    if (index->buckets == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(index->buckets, n * sizeof(ngx_uint_t));
+
+    index->next = index->buckets + n;
+    index->mask = n - 1;
+    index->peers_shm = peers_shm;
+
+    /* the chains keep the peer order, entries are the peer index plus 1 */
+
+    for (i = peers_shm->number; i > 0; i--) {
+        peer_shm = &peers_shm->peers[i - 1];
+
+        key = ngx_murmur_hash2((u_char *) peer_shm->sockaddr,
+                               peer_shm->socklen) & index->mask;
+
+        index->next[i - 1] = index->buckets[key];
+        index->buckets[key] = i;
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_http_upstream_check_peer_shm_t *
-ngx_http_upstream_check_find_shm_peer(ngx_http_upstream_check_peers_shm_t *p,
-    ngx_addr_t *addr)
+ngx_http_upstream_check_find_shm_peer(ngx_http_upstream_check_shm_index_t *index,
+    ngx_addr_t *addr, uint32_t upstream_hash)
 {
-    ngx_uint_t                          i;
-    ngx_http_upstream_check_peer_shm_t *peer_shm;
+    ngx_uint_t                          i, key;
+    ngx_http_upstream_check_peer_shm_t *peer_shm, *found;
 
-    for (i = 0; i < p->number; i++) {
+    key = ngx_murmur_hash2((u_char *) addr->sockaddr, addr->socklen)
+          & index->mask;
 
-        peer_shm = &p->peers[i];
+    found = NULL;
+
+    for (i = index->buckets[key]; i; i = index->next[i - 1]) {
+
+        peer_shm = &index->peers_shm->peers[i - 1];
 
         if (addr->socklen != peer_shm->socklen) {
             continue;
         }
 
-        if (ngx_memcmp(addr->sockaddr, peer_shm->sockaddr, addr->socklen) == 0) {
+        if (ngx_memcmp(addr->sockaddr, peer_shm->sockaddr, addr->socklen) != 0) {
+            continue;
+        }
+
+        /* the same server may be checked in several upstreams */
+
+        if (peer_shm->upstream_hash == upstream_hash) {
             return peer_shm;
         }
+
+        if (found == NULL) {
+            found = peer_shm;
+        }
     }
 
-    return NULL;
+    return found;
 }
 
 
@@ -4016,25 +8266,42 @@ ngx_http_upstream_check_init_shm_peer(ngx_http_upstream_check_peer_shm_t *psh,
     ngx_http_upstream_check_peer_shm_t *opsh, ngx_uint_t init_down,
     ngx_pool_t *pool, ngx_str_t *name)
 {
-    u_char  *file;
+    u_char      *file;
+    ngx_uint_t   i;
 
     if (opsh) {
         psh->access_time  = opsh->access_time;
-        psh->access_count = opsh->access_count;
 
         psh->fall_count   = opsh->fall_count;
         psh->rise_count   = opsh->rise_count;
-        psh->busyness     = opsh->busyness;
 
         psh->down         = opsh->down;
+        psh->passive_down = opsh->passive_down;
+
+        psh->checks       = opsh->checks;
+        psh->failures     = opsh->failures;
+        psh->timeouts     = opsh->timeouts;
+
+        psh->duration_sum = opsh->duration_sum;
+
+        for (i = 0; i < NGX_HTTP_CHECK_DURATION_BUCKETS; i++) {
+            psh->duration[i] = opsh->duration[i];
+        }
+
+        for (i = 0; i < NGX_HTTP_CHECK_PHASES; i++) {
+            psh->phase_last[i] = opsh->phase_last[i];
+            psh->phase_avg[i] = opsh->phase_avg[i];
+        }
+
+        psh->srtt         = opsh->srtt;
+        psh->recovered    = opsh->recovered;
+        psh->interval     = opsh->interval;
 
     } else {
         psh->access_time  = 0;
-        psh->access_count = 0;
 
         psh->fall_count   = 0;
         psh->rise_count   = 0;
-        psh->busyness     = 0;
 
         psh->down         = init_down;
     }
@@ -11,8 +11,72 @@ ngx_uint_t ngx_http_upstream_check_add_peer(ngx_conf_t *cf,
 
 ngx_uint_t ngx_http_upstream_check_peer_down(ngx_uint_t index);
 
+/*
+ * Returns the part of its weight a peer should get, it ramps up from 0 to
+ * NGX_HTTP_UPSTREAM_CHECK_WEIGHT_FACTOR over the check slow_start time after
+ * the peer went up.
+ */
+#define NGX_HTTP_UPSTREAM_CHECK_WEIGHT_FACTOR  1000
+
+ngx_uint_t ngx_http_upstream_check_peer_weight_factor(ngx_uint_t index);
+
+/*
+ * Ramps a balancer weight up over the check slow_start, the weight is
+ * multiplied by NGX_HTTP_UPSTREAM_CHECK_WEIGHT_SCALE beforehand so a peer
+ * of weight 1 is throttled too. The result is at least 1.
+ */
+#define NGX_HTTP_UPSTREAM_CHECK_WEIGHT_SCALE  100
+
+ngx_int_t ngx_http_upstream_check_slow_start_weight(ngx_uint_t index,
+    ngx_int_t weight);
+
+/*
+ * Returns the smoothed round trip time of the checks of the peer in msec,
+ * 0 while it is not known or the peer is not checked.
+ */
+ngx_msec_t ngx_http_upstream_check_peer_rtt(ngx_uint_t index);
+
+/*
+ * Scales a balancer weight by the round trip time of the peer, a peer with
+ * an rtt of NGX_HTTP_UPSTREAM_CHECK_RTT_BIAS msec weighs half of a peer
+ * answering at once. The result is at least 1 and is multiplied by
+ * NGX_HTTP_UPSTREAM_CHECK_RTT_SCALE to keep the precision.
+ */
+#define NGX_HTTP_UPSTREAM_CHECK_RTT_BIAS   10
+#define NGX_HTTP_UPSTREAM_CHECK_RTT_SCALE  NGX_HTTP_UPSTREAM_CHECK_WEIGHT_SCALE
+
+ngx_int_t ngx_http_upstream_check_rtt_weight(ngx_uint_t index,
+    ngx_int_t weight);
+
+/*
+ * Returns the down bits of the peers [index, index + n), bit i stands for
+ * the peer index + i, n is at most NGX_HTTP_UPSTREAM_CHECK_MAP_BITS.
+ * The generation changes whenever any peer goes up or down.
+ */
+#define NGX_HTTP_UPSTREAM_CHECK_MAP_BITS  (8 * sizeof(uintptr_t))
+
+uintptr_t ngx_http_upstream_check_peers_down_map(ngx_uint_t index,
+    ngx_uint_t n, ngx_uint_t *generation);
+
+/*
+ * Sets bit i of the alive bitmask for every alive peer index[i] and returns
+ * the number of them, the bitmask must hold n bits. Unchecked indexes
+ * (NGX_ERROR) are reported alive.
+ */
+ngx_uint_t ngx_http_upstream_check_peers_filter(ngx_uint_t *index,
+    ngx_uint_t n, uintptr_t *alive);
+
 void ngx_http_upstream_check_get_peer(ngx_uint_t index);
-void ngx_http_upstream_check_free_peer(ngx_uint_t index);
+
+/*
+ * Reports the response of a peer to check_passive, the status is the
+ * upstream status code, 502 or 504 for an error or a timeout, and 0 when
+ * it is not known. The balancers pass the check_status and the
+ * check_response_time that ngx_http_upstream.c sets on the peer
+ * connection before freeing the peer.
+ */
+void ngx_http_upstream_check_free_peer(ngx_uint_t index, ngx_uint_t status,
+    ngx_msec_t response_time);
 
 
 #endif //_NGX_HTTP_UPSTREAM_CHECK_MODELE_H_INCLUDED_
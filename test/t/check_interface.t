@@ -520,3 +520,42 @@ GET /status
 --- response_headers
 Content-Type: text/html
 --- response_body_like: ^.*Check upstream server number: 6.*$
+
+=== TEST 14: the http_check interface, openmetrics
+--- http_config
+upstream backend {
+    server 127.0.0.1:1971;
+    server 127.0.0.1:1972;
+    server 127.0.0.1:1973;
+    server 127.0.0.1:1970;
+    server 127.0.0.1:1974;
+    server 127.0.0.1:1975;
+
+    check interval=3000 rise=1 fall=1 timeout=1000 type=http;
+    check_http_send "GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n";
+    check_http_expect_alive http_2xx http_3xx;
+}
+
+server {
+    listen 1970;
+
+    location / {
+        root   html;
+        index  index.html index.htm;
+    }
+}
+
+--- config
+    location / {
+        proxy_pass http://backend;
+    }
+
+    location /status {
+        check_status openmetrics;
+    }
+
+--- request
+GET /status
+--- response_headers
+Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8
+--- response_body_like: ^# TYPE nginx_upstream_check_up gauge\n.*nginx_upstream_check_up\{upstream="backend",name="127.0.0.1:1970",type="http"\} 1\n.*nginx_upstream_check_duration_seconds_bucket\{.*le="\+Inf"\} \d+\n.*# EOF\n$